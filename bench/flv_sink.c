@@ -0,0 +1,258 @@
+// flv_sink.c
+//
+// FLV-over-TCP receiver for the end-to-end benchmark. One thread polls the
+// listening socket and every connection, and parses the FLV header and tags
+// as they arrive. Only what is needed for measuring is kept: byte and tag
+// counts, and the arrival time of each audio tag.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "flv_sink.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FLV_HEADER_SIZE 9
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_PREV_TAG_SIZE 4
+#define FLV_TAG_AUDIO 8
+#define FLV_SOUND_FORMAT_AAC 10
+// Largest tag the sink accepts; audio tags are a few kilobytes at most
+#define FLV_SINK_BUFFER (256 * 1024)
+#define FLV_SINK_POLL_MS 20
+
+typedef struct _flv_conn {
+  int fd;                 // -1 once closed
+  unsigned char *buf;     // Bytes received but not parsed yet
+  size_t fill;
+  int header_done;        // FLV header and first PreviousTagSize consumed
+} t_flv_conn;
+
+struct _flv_sink {
+  int listen_fd;
+  int port;
+  t_flv_conn *conns;
+  int max_connections;
+  t_flv_sink_audio_fn audio_fn;
+  void *ctx;
+  t_flv_sink_stats stats; // Sink thread only until joined
+  pthread_t thread;
+  atomic_int quit;        // Stop once every connection is closed
+  atomic_llong deadline;  // CLOCK_MONOTONIC ns after which quit is forced
+};
+
+static int64_t sink_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t read_be24(const unsigned char *p) {
+  return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static void conn_close(t_flv_conn *c) {
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+  free(c->buf);
+  c->buf = NULL;
+  c->fill = 0;
+}
+
+// Parse every complete tag in the buffer. Returns -1 on malformed input.
+static int conn_parse(t_flv_sink *sink, int index, int64_t arrival) {
+  t_flv_conn *c = &sink->conns[index];
+  size_t pos = 0;
+
+  if (!c->header_done) {
+    if (c->fill < FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE)
+      return 0;
+    if (memcmp(c->buf, "FLV", 3) != 0)
+      return -1;
+    uint32_t offset = ((uint32_t)c->buf[5] << 24) | read_be24(c->buf + 6);
+    if (offset < FLV_HEADER_SIZE || offset > FLV_SINK_BUFFER / 2)
+      return -1;
+    if (c->fill < offset + FLV_PREV_TAG_SIZE)
+      return 0;
+    pos = offset + FLV_PREV_TAG_SIZE;
+    c->header_done = 1;
+  }
+
+  while (c->fill - pos >= FLV_TAG_HEADER_SIZE) {
+    const unsigned char *tag = c->buf + pos;
+    uint32_t size = read_be24(tag + 1);
+    size_t total = FLV_TAG_HEADER_SIZE + size + FLV_PREV_TAG_SIZE;
+    if (total > FLV_SINK_BUFFER)
+      return -1;
+    if (c->fill - pos < total)
+      break;
+
+    if ((tag[0] & 0x1f) == FLV_TAG_AUDIO && size > 0) {
+      const unsigned char *data = tag + FLV_TAG_HEADER_SIZE;
+      // Timestamps are 24 bits plus an extension byte for the top bits
+      int64_t timestamp = (int32_t)(read_be24(tag + 4) | ((uint32_t)tag[7] << 24));
+      int sequence_header =
+          (data[0] >> 4) == FLV_SOUND_FORMAT_AAC && size > 1 && data[1] == 0;
+      if (!sequence_header) {
+        sink->stats.audio_tags++;
+        if (sink->audio_fn)
+          sink->audio_fn(sink->ctx, index, timestamp, arrival, (int)size);
+      }
+    }
+    pos += total;
+  }
+
+  memmove(c->buf, c->buf + pos, c->fill - pos);
+  c->fill -= pos;
+  return 0;
+}
+
+static void sink_accept(t_flv_sink *sink) {
+  for (;;) {
+    int fd = accept(sink->listen_fd, NULL, NULL);
+    if (fd < 0)
+      return;
+    if (sink->stats.connections == sink->max_connections) {
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    t_flv_conn *c = &sink->conns[sink->stats.connections++];
+    c->fd = fd;
+    c->buf = (unsigned char *)malloc(FLV_SINK_BUFFER);
+    c->fill = 0;
+    c->header_done = 0;
+  }
+}
+
+static void sink_read(t_flv_sink *sink, int index) {
+  t_flv_conn *c = &sink->conns[index];
+  for (;;) {
+    ssize_t n = read(c->fd, c->buf + c->fill, FLV_SINK_BUFFER - c->fill);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      conn_close(c); // Sender finished or reset the connection
+      return;
+    }
+
+    int64_t arrival = sink_now_ns();
+    if (!sink->stats.first_byte_ns)
+      sink->stats.first_byte_ns = arrival;
+    sink->stats.last_byte_ns = arrival;
+    sink->stats.bytes += (uint64_t)n;
+    c->fill += (size_t)n;
+    if (conn_parse(sink, index, arrival) < 0) {
+      sink->stats.errors++;
+      conn_close(c);
+      return;
+    }
+  }
+}
+
+static void *sink_main(void *arg) {
+  t_flv_sink *sink = (t_flv_sink *)arg;
+  struct pollfd *fds = (struct pollfd *)calloc(sink->max_connections + 1,
+                                               sizeof(struct pollfd));
+  int *index = (int *)calloc(sink->max_connections + 1, sizeof(int));
+
+  for (;;) {
+    int nfds = 0, open = 0;
+    fds[nfds].fd = sink->listen_fd;
+    fds[nfds++].events = POLLIN;
+    for (int i = 0; i < sink->stats.connections; i++) {
+      if (sink->conns[i].fd < 0)
+        continue;
+      fds[nfds].fd = sink->conns[i].fd;
+      fds[nfds].events = POLLIN;
+      index[nfds++] = i;
+      open++;
+    }
+
+    if (atomic_load(&sink->quit) &&
+        (open == 0 || sink_now_ns() >= atomic_load(&sink->deadline)))
+      break;
+
+    if (poll(fds, nfds, FLV_SINK_POLL_MS) <= 0)
+      continue;
+    if (fds[0].revents & POLLIN)
+      sink_accept(sink);
+    for (int i = 1; i < nfds; i++)
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        sink_read(sink, index[i]);
+  }
+
+  free(index);
+  free(fds);
+  return NULL;
+}
+
+t_flv_sink *flv_sink_start(int max_connections, t_flv_sink_audio_fn audio_fn,
+                           void *ctx) {
+  t_flv_sink *sink = (t_flv_sink *)calloc(1, sizeof(t_flv_sink));
+  if (!sink)
+    return NULL;
+  sink->max_connections = max_connections;
+  sink->audio_fn = audio_fn;
+  sink->ctx = ctx;
+  sink->conns = (t_flv_conn *)calloc(max_connections, sizeof(t_flv_conn));
+  atomic_init(&sink->quit, 0);
+  atomic_init(&sink->deadline, 0);
+
+  sink->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sink->listen_fd < 0 || !sink->conns)
+    goto fail;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0; // Ephemeral
+  socklen_t len = sizeof(addr);
+  if (bind(sink->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sink->listen_fd, max_connections) < 0 ||
+      getsockname(sink->listen_fd, (struct sockaddr *)&addr, &len) < 0)
+    goto fail;
+  sink->port = ntohs(addr.sin_port);
+  fcntl(sink->listen_fd, F_SETFL, fcntl(sink->listen_fd, F_GETFL) | O_NONBLOCK);
+
+  if (pthread_create(&sink->thread, NULL, sink_main, sink) != 0)
+    goto fail;
+  return sink;
+
+fail:
+  if (sink->listen_fd >= 0)
+    close(sink->listen_fd);
+  free(sink->conns);
+  free(sink);
+  return NULL;
+}
+
+int flv_sink_port(t_flv_sink *sink) { return sink->port; }
+
+void flv_sink_stop(t_flv_sink *sink, int timeout_ms, t_flv_sink_stats *stats) {
+  atomic_store(&sink->deadline, sink_now_ns() + timeout_ms * 1000000LL);
+  atomic_store(&sink->quit, 1);
+  pthread_join(sink->thread, NULL);
+
+  for (int i = 0; i < sink->stats.connections; i++)
+    conn_close(&sink->conns[i]);
+  close(sink->listen_fd);
+  if (stats)
+    *stats = sink->stats;
+  free(sink->conns);
+  free(sink);
+}
@@ -0,0 +1,41 @@
+// flv_sink.h
+//
+// Local stand-in for a media server: accepts FLV-over-TCP connections on
+// 127.0.0.1 and parses the tag stream, so rtmpstreamer~ can be measured end
+// to end without network access.
+
+#ifndef RTMPSTREAMER_BENCH_FLV_SINK_H
+#define RTMPSTREAMER_BENCH_FLV_SINK_H
+
+#include <stdint.h>
+
+typedef struct _flv_sink t_flv_sink;
+
+// Called on the sink thread for every audio tag carrying coded audio (AAC
+// sequence headers are skipped). timestamp is the tag time in milliseconds,
+// arrival_ns the CLOCK_MONOTONIC time the complete tag was read.
+typedef void (*t_flv_sink_audio_fn)(void *ctx, int conn, int64_t timestamp,
+                                    int64_t arrival_ns, int size);
+
+typedef struct _flv_sink_stats {
+  int connections;         // Connections accepted
+  int errors;              // Connections dropped due to malformed FLV
+  uint64_t bytes;          // Bytes received, all connections
+  uint64_t audio_tags;     // Audio tags received, all connections
+  int64_t first_byte_ns;   // Arrival of the first byte, 0 if none
+  int64_t last_byte_ns;    // Arrival of the last byte
+} t_flv_sink_stats;
+
+// Listen on an ephemeral port of 127.0.0.1 and start the sink thread.
+// Accepts up to max_connections streams. Returns NULL on failure.
+t_flv_sink *flv_sink_start(int max_connections, t_flv_sink_audio_fn audio_fn,
+                           void *ctx);
+
+// Port the sink listens on
+int flv_sink_port(t_flv_sink *sink);
+
+// Wait for the senders to close their connections (at most timeout_ms),
+// stop the sink thread and free it. stats may be NULL.
+void flv_sink_stop(t_flv_sink *sink, int timeout_ms, t_flv_sink_stats *stats);
+
+#endif // RTMPSTREAMER_BENCH_FLV_SINK_H
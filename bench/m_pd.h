@@ -0,0 +1,121 @@
+// m_pd.h
+//
+// Minimal stand-in for Pure Data's m_pd.h, used by the headless benchmark.
+// It declares only the part of the Pd API that rtmpstreamer~.c uses, with
+// the same names and signatures, so the external compiles unchanged. The
+// functions are implemented in m_pd_stub.c.
+//
+// Never install this header or build the external itself against it.
+
+#ifndef RTMPSTREAMER_BENCH_M_PD_H
+#define RTMPSTREAMER_BENCH_M_PD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PD_FLOATSIZE 32
+
+typedef intptr_t t_int;
+typedef float t_float;
+typedef float t_floatarg;
+typedef float t_sample;
+
+typedef struct _class t_class;
+typedef t_class *t_pd;
+typedef struct _outlet t_outlet;
+typedef struct _inlet t_inlet;
+typedef struct _clock t_clock;
+
+typedef struct _symbol {
+  const char *s_name;
+  struct _symbol *s_next;
+} t_symbol;
+
+typedef enum {
+  A_NULL,
+  A_FLOAT,
+  A_SYMBOL,
+  A_POINTER,
+  A_SEMI,
+  A_COMMA,
+  A_DEFFLOAT,
+  A_DEFSYM,
+  A_DOLLAR,
+  A_DOLLSYM,
+  A_GIMME,
+  A_CANT
+} t_atomtype;
+
+typedef union word {
+  t_float w_float;
+  t_symbol *w_symbol;
+} t_word;
+
+typedef struct _atom {
+  t_atomtype a_type;
+  union word a_w;
+} t_atom;
+
+typedef struct _object {
+  t_pd ob_pd;
+} t_object;
+
+typedef struct _signal {
+  int s_n;         // Block size
+  t_sample *s_vec; // Samples
+  t_float s_sr;    // Sample rate
+} t_signal;
+
+typedef t_int *(*t_perfroutine)(t_int *w);
+typedef void *(*t_newmethod)(void);
+typedef void (*t_method)(void);
+
+extern t_symbol s_signal, s_symbol;
+
+#define CLASS_DEFAULT 0
+#define MAXPDSTRING 1000
+
+#define SETFLOAT(atom, f) ((atom)->a_type = A_FLOAT, (atom)->a_w.w_float = (f))
+#define SETSYMBOL(atom, s)                                                     \
+  ((atom)->a_type = A_SYMBOL, (atom)->a_w.w_symbol = (s))
+
+t_symbol *gensym(const char *s);
+void *pd_new(t_class *cls);
+void pd_free(t_pd *x);
+
+t_class *class_new(t_symbol *name, t_newmethod newmethod, t_method freemethod,
+                   size_t size, int flags, t_atomtype arg1, ...);
+void class_addmethod(t_class *c, t_method fn, t_symbol *sel, t_atomtype arg1,
+                     ...);
+void class_addsymbol(t_class *c, t_method fn);
+void class_domainsignalin(t_class *c, int onset);
+#define class_addsymbol(x, y) class_addsymbol(x, (t_method)(y))
+#define CLASS_MAINSIGNALIN(c, type, field)                                     \
+  class_domainsignalin(c, (int)offsetof(type, field))
+
+void dsp_addv(t_perfroutine f, int n, t_int *vec);
+
+t_inlet *inlet_new(t_object *owner, t_pd *dest, t_symbol *s1, t_symbol *s2);
+t_outlet *outlet_new(t_object *owner, t_symbol *s);
+void outlet_anything(t_outlet *x, t_symbol *s, int argc, t_atom *argv);
+
+void post(const char *fmt, ...);
+void pd_error(const void *object, const char *fmt, ...);
+void logpost(const void *object, int level, const char *fmt, ...);
+
+t_float sys_getsr(void);
+
+t_clock *clock_new(void *owner, t_method fn);
+void clock_delay(t_clock *x, double delaytime);
+void clock_unset(t_clock *x);
+void clock_free(t_clock *x);
+double clock_getlogicaltime(void);
+double clock_gettimesince(double prevsystime);
+
+void *getbytes(size_t nbytes);
+void freebytes(void *x, size_t nbytes);
+
+t_float atom_getfloat(const t_atom *a);
+t_symbol *atom_getsymbol(const t_atom *a);
+
+#endif // RTMPSTREAMER_BENCH_M_PD_H
@@ -0,0 +1,324 @@
+// m_pd_stub.c
+//
+// Just enough of Pure Data for the headless benchmark: symbols, classes with
+// typed methods, a single DSP chain, clocks driven by pd_stub_advance() and
+// the memory and printing helpers. Everything runs on the calling thread,
+// which plays the part of Pd's scheduler.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "pd_stub.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STUB_MAX_METHODS 32
+
+struct _class {
+  t_symbol *name;
+  size_t size;
+  t_method freemethod;
+  struct {
+    t_symbol *sel;
+    t_method fn;
+    t_atomtype args[2]; // Argument types, A_NULL terminated
+  } methods[STUB_MAX_METHODS];
+  int num_methods;
+};
+
+struct _clock {
+  void *owner;
+  t_method fn;
+  double due; // Logical time the clock fires at, negative if unset
+  struct _clock *next;
+};
+
+struct _outlet {
+  t_object *owner;
+};
+
+struct _inlet {
+  t_object *owner;
+};
+
+t_symbol s_signal = {"signal", NULL};
+t_symbol s_symbol = {"symbol", NULL};
+
+static t_symbol *symbols;
+static t_float samplerate = 48000;
+static t_int *dsp_chain; // Grown as objects add themselves
+static size_t dsp_chain_size, dsp_chain_capacity;
+static t_clock *clocks;
+static double logical_time;
+static int verbose = 1;
+// The external's worker threads allocate too, so the count is atomic; each
+// thread also keeps its own
+static atomic_ulong getbytes_count;
+static _Thread_local unsigned long thread_getbytes_count;
+
+// Symbols
+
+t_symbol *gensym(const char *s) {
+  for (t_symbol *sym = symbols; sym; sym = sym->s_next)
+    if (!strcmp(sym->s_name, s))
+      return sym;
+  t_symbol *sym = (t_symbol *)malloc(sizeof(t_symbol));
+  sym->s_name = strdup(s);
+  sym->s_next = symbols;
+  symbols = sym;
+  return sym;
+}
+
+t_float atom_getfloat(const t_atom *a) {
+  return a->a_type == A_FLOAT ? a->a_w.w_float : 0;
+}
+
+t_symbol *atom_getsymbol(const t_atom *a) {
+  return a->a_type == A_SYMBOL ? a->a_w.w_symbol : gensym("");
+}
+
+// Classes and objects
+
+t_class *class_new(t_symbol *name, t_newmethod newmethod, t_method freemethod,
+                   size_t size, int flags, t_atomtype arg1, ...) {
+  t_class *c = (t_class *)calloc(1, sizeof(t_class));
+  c->name = name;
+  c->size = size;
+  c->freemethod = freemethod;
+  return c;
+}
+
+void class_addmethod(t_class *c, t_method fn, t_symbol *sel, t_atomtype arg1,
+                     ...) {
+  if (c->num_methods == STUB_MAX_METHODS)
+    return;
+  c->methods[c->num_methods].sel = sel;
+  c->methods[c->num_methods].fn = fn;
+  c->methods[c->num_methods].args[0] = arg1;
+  c->methods[c->num_methods].args[1] = A_NULL;
+  if (arg1 != A_NULL && arg1 != A_GIMME) {
+    va_list ap;
+    va_start(ap, arg1);
+    c->methods[c->num_methods].args[1] = (t_atomtype)va_arg(ap, int);
+    va_end(ap);
+  }
+  c->num_methods++;
+}
+
+#undef class_addsymbol
+void class_addsymbol(t_class *c, t_method fn) {
+  class_addmethod(c, fn, &s_symbol, A_SYMBOL, 0);
+}
+
+void class_domainsignalin(t_class *c, int onset) {}
+
+void *pd_new(t_class *cls) {
+  t_object *x = (t_object *)getbytes(cls->size);
+  x->ob_pd = cls;
+  return x;
+}
+
+void pd_free(t_pd *x) {
+  t_class *c = *x;
+  if (c->freemethod)
+    ((void (*)(void *))c->freemethod)(x);
+  freebytes(x, c->size);
+}
+
+int pd_stub_send(void *obj, const char *sel, int argc, t_atom *argv) {
+  t_class *c = ((t_object *)obj)->ob_pd;
+  t_symbol *s = gensym(sel);
+  for (int i = 0; i < c->num_methods; i++) {
+    if (c->methods[i].sel != s)
+      continue;
+    t_atomtype *types = c->methods[i].args;
+    t_floatarg f = argc > 0 ? atom_getfloat(argv) : 0;
+    t_symbol *sym = argc > 0 ? atom_getsymbol(argv) : gensym("");
+    switch (types[0]) {
+    case A_GIMME:
+      ((void (*)(void *, t_symbol *, int, t_atom *))c->methods[i].fn)(
+          obj, s, argc, argv);
+      return 0;
+    case A_FLOAT:
+    case A_DEFFLOAT:
+      ((void (*)(void *, t_floatarg))c->methods[i].fn)(obj, f);
+      return 0;
+    case A_SYMBOL:
+    case A_DEFSYM:
+      if (types[1] == A_FLOAT || types[1] == A_DEFFLOAT)
+        ((void (*)(void *, t_symbol *, t_floatarg))c->methods[i].fn)(
+            obj, sym, argc > 1 ? atom_getfloat(argv + 1) : 0);
+      else
+        ((void (*)(void *, t_symbol *))c->methods[i].fn)(obj, sym);
+      return 0;
+    default:
+      ((void (*)(void *))c->methods[i].fn)(obj);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Inlets and outlets
+
+t_inlet *inlet_new(t_object *owner, t_pd *dest, t_symbol *s1, t_symbol *s2) {
+  t_inlet *in = (t_inlet *)calloc(1, sizeof(t_inlet));
+  in->owner = owner;
+  return in;
+}
+
+t_outlet *outlet_new(t_object *owner, t_symbol *s) {
+  t_outlet *out = (t_outlet *)calloc(1, sizeof(t_outlet));
+  out->owner = owner;
+  return out;
+}
+
+void outlet_anything(t_outlet *x, t_symbol *s, int argc, t_atom *argv) {
+  if (!verbose)
+    return;
+  fprintf(stderr, "outlet: %s", s->s_name);
+  for (int i = 0; i < argc; i++) {
+    if (argv[i].a_type == A_FLOAT)
+      fprintf(stderr, " %g", argv[i].a_w.w_float);
+    else if (argv[i].a_type == A_SYMBOL)
+      fprintf(stderr, " %s", argv[i].a_w.w_symbol->s_name);
+  }
+  fprintf(stderr, "\n");
+}
+
+// DSP
+
+t_float sys_getsr(void) { return samplerate; }
+
+void pd_stub_set_samplerate(t_float sr) { samplerate = sr; }
+
+void dsp_addv(t_perfroutine f, int n, t_int *vec) {
+  if (dsp_chain_size + n + 1 > dsp_chain_capacity) {
+    size_t capacity = dsp_chain_capacity ? dsp_chain_capacity * 2 : 256;
+    while (capacity < dsp_chain_size + n + 1)
+      capacity *= 2;
+    t_int *chain = (t_int *)realloc(dsp_chain, capacity * sizeof(t_int));
+    if (!chain) {
+      // A partial chain would silently leave objects out of the run
+      fprintf(stderr, "dsp_addv: out of memory\n");
+      abort();
+    }
+    dsp_chain = chain;
+    dsp_chain_capacity = capacity;
+  }
+  dsp_chain[dsp_chain_size] = (t_int)f;
+  memcpy(&dsp_chain[dsp_chain_size + 1], vec, n * sizeof(t_int));
+  dsp_chain_size += n + 1;
+}
+
+void pd_stub_dsp_tick(void) {
+  t_int *w = dsp_chain;
+  while (w < dsp_chain + dsp_chain_size)
+    w = ((t_perfroutine)w[0])(w);
+}
+
+void pd_stub_dsp_clear(void) { dsp_chain_size = 0; }
+
+// Clocks
+
+t_clock *clock_new(void *owner, t_method fn) {
+  t_clock *x = (t_clock *)calloc(1, sizeof(t_clock));
+  x->owner = owner;
+  x->fn = fn;
+  x->due = -1;
+  x->next = clocks;
+  clocks = x;
+  return x;
+}
+
+void clock_delay(t_clock *x, double delaytime) {
+  x->due = logical_time + (delaytime > 0 ? delaytime : 0);
+}
+
+void clock_unset(t_clock *x) { x->due = -1; }
+
+void clock_free(t_clock *x) {
+  for (t_clock **p = &clocks; *p; p = &(*p)->next) {
+    if (*p == x) {
+      *p = x->next;
+      break;
+    }
+  }
+  free(x);
+}
+
+double clock_getlogicaltime(void) { return logical_time; }
+
+double clock_gettimesince(double prevsystime) {
+  return logical_time - prevsystime;
+}
+
+void pd_stub_advance(double ms) {
+  logical_time += ms;
+  // A callback may re-arm or free clocks, so rescan after every call
+  for (;;) {
+    t_clock *due = NULL;
+    for (t_clock *c = clocks; c; c = c->next)
+      if (c->due >= 0 && c->due <= logical_time &&
+          (!due || c->due < due->due))
+        due = c;
+    if (!due)
+      break;
+    due->due = -1;
+    ((void (*)(void *))due->fn)(due->owner);
+  }
+}
+
+// Memory
+
+void *getbytes(size_t nbytes) {
+  atomic_fetch_add_explicit(&getbytes_count, 1, memory_order_relaxed);
+  thread_getbytes_count++;
+  return calloc(1, nbytes ? nbytes : 1);
+}
+
+void freebytes(void *x, size_t nbytes) { free(x); }
+
+unsigned long pd_stub_getbytes_count(void) {
+  return atomic_load_explicit(&getbytes_count, memory_order_relaxed);
+}
+
+unsigned long pd_stub_thread_getbytes_count(void) {
+  return thread_getbytes_count;
+}
+
+// Printing
+
+void pd_stub_set_verbose(int v) { verbose = v; }
+
+static void stub_vprint(const char *prefix, const char *fmt, va_list ap) {
+  if (!verbose)
+    return;
+  fputs(prefix, stderr);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+}
+
+void post(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  stub_vprint("", fmt, ap);
+  va_end(ap);
+}
+
+void pd_error(const void *object, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  stub_vprint("error: ", fmt, ap);
+  va_end(ap);
+}
+
+void logpost(const void *object, int level, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  stub_vprint("", fmt, ap);
+  va_end(ap);
+}
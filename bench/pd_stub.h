@@ -0,0 +1,34 @@
+// pd_stub.h
+//
+// Controls for the Pd stand-in in m_pd_stub.c: the benchmark uses these in
+// place of Pd's scheduler and audio driver.
+
+#ifndef RTMPSTREAMER_BENCH_PD_STUB_H
+#define RTMPSTREAMER_BENCH_PD_STUB_H
+
+#include "m_pd.h"
+
+// Sample rate returned by sys_getsr()
+void pd_stub_set_samplerate(t_float sr);
+
+// Run every perform routine added by dsp_addv() once, in order
+void pd_stub_dsp_tick(void);
+
+// Drop the DSP chain, as Pd does before rebuilding it
+void pd_stub_dsp_clear(void);
+
+// Advance logical time by ms milliseconds, firing clocks that fall due
+void pd_stub_advance(double ms);
+
+// Print post() and pd_error() output (default on)
+void pd_stub_set_verbose(int verbose);
+
+// Calls to getbytes() so far, from all threads and from the calling one
+unsigned long pd_stub_getbytes_count(void);
+unsigned long pd_stub_thread_getbytes_count(void);
+
+// Deliver a message to a method registered with class_addmethod(), the way
+// Pd's typed message dispatch would
+int pd_stub_send(void *obj, const char *sel, int argc, t_atom *argv);
+
+#endif // RTMPSTREAMER_BENCH_PD_STUB_H
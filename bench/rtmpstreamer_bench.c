@@ -0,0 +1,429 @@
+// rtmpstreamer_bench.c
+//
+// Headless benchmark for rtmpstreamer~. Builds the external against the
+// m_pd.h stand-in in this directory, feeds synthetic audio through its
+// perform routine at several block sizes, channel counts and codecs, with
+// and without a bitrate ladder, and streams the result into a file or null
+// muxer.
+//
+// For every configuration it reports the cost of the perform routine (ns
+// per block, mean and max), the CPU use of the whole process (perform
+// routine, encoder and writer threads), the number of allocations made on
+// the DSP thread and in total per block and per packet, and how often the
+// frame and packet pools ran dry. A run fails if the steady state allocates
+// on the DSP thread, misses the pools, or allocates more per packet than
+// FFmpeg's references and muxer account for.
+//
+// Usage: rtmpstreamer_bench [-o url] [-t seconds] [-r samplerate]
+//                           [-b blocksizes] [-c channels] [-k codecs]
+//                           [-l ladder] [-f] [-v]
+//
+//   -o  output URL or path (default /dev/null)
+//   -t  seconds of audio per configuration (default 2)
+//   -r  sample rate (default 48000)
+//   -b  comma-separated block sizes (default 64,256,1024)
+//   -c  comma-separated channel counts (default 1,2,8)
+//   -k  comma-separated codecs (default aac)
+//   -l  comma-separated ladder bitrates in kbps for the ladder runs, or off
+//       (default 128,64,32)
+//   -f  run as fast as possible instead of in real time
+//   -v  print the external's messages
+
+#define _POSIX_C_SOURCE 200809L
+
+// The external is compiled into the benchmark so its internals (streaming
+// state, counters) can be inspected directly
+#include "rtmpstreamer~.c"
+
+#include "pd_stub.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#define BENCH_MAX_LIST 16
+#define BENCH_CONNECT_TIMEOUT_MS 5000
+#define BENCH_TWO_PI 6.283185307179586
+// Steady state allocations allowed per encoded packet besides one per input
+// channel, which libavcodec makes referencing the planes of each frame: the
+// reference to the pooled packet buffer, the reference each output takes, and
+// what the muxer allocates to queue a packet
+#define BENCH_ALLOCS_PER_PACKET 8
+
+// Allocation counting
+
+#if defined(__GLIBC__)
+// Interpose the allocator so allocations made by FFmpeg are counted too
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static atomic_ulong alloc_count;          // All threads
+static _Thread_local unsigned long thread_alloc_count; // Calling thread
+
+static void count_alloc(void) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  thread_alloc_count++;
+}
+
+void *malloc(size_t size) {
+  count_alloc();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  count_alloc();
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  count_alloc();
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  count_alloc();
+  void *p = __libc_memalign(alignment, size);
+  if (!p)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  count_alloc();
+  return __libc_memalign(alignment, size);
+}
+#else
+// Only getbytes() calls can be counted
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+static unsigned long process_allocs(void) {
+#if BENCH_COUNT_ALLOCS
+  return atomic_load(&alloc_count);
+#else
+  return pd_stub_getbytes_count();
+#endif
+}
+
+// Called on the thread that runs the perform routine
+static unsigned long dsp_thread_allocs(void) {
+#if BENCH_COUNT_ALLOCS
+  return thread_alloc_count;
+#else
+  return pd_stub_thread_getbytes_count();
+#endif
+}
+
+// Helpers
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t cpu_time_ns(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+         ((int64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static void sleep_until_ns(int64_t deadline) {
+  int64_t wait = deadline - now_ns();
+  if (wait <= 0)
+    return;
+  struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+  nanosleep(&ts, NULL);
+}
+
+// Send "stop" and keep Pd's clock going until the session has flushed the
+// encoder and closed its outputs in the background
+static void stop_streaming(t_rtmpstreamer_tilde *x) {
+  pd_stub_send(x, "stop", 0, NULL);
+  while (x->worker_running) {
+    pd_stub_advance(RTMP_TICK_MS);
+    sleep_until_ns(now_ns() + RTMP_TICK_MS * 1000000LL);
+  }
+}
+
+// Parse a comma-separated list of positive integers
+static int parse_int_list(const char *arg, int *list) {
+  int n = 0;
+  char *end;
+  while (*arg && n < BENCH_MAX_LIST) {
+    long v = strtol(arg, &end, 10);
+    if (end == arg || v <= 0)
+      return -1;
+    list[n++] = (int)v;
+    arg = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+// Split a comma-separated list of names in place
+static int parse_name_list(char *arg, char **list) {
+  int n = 0;
+  for (char *tok = strtok(arg, ","); tok && n < BENCH_MAX_LIST;
+       tok = strtok(NULL, ","))
+    list[n++] = tok;
+  return n;
+}
+
+// One configuration
+
+typedef struct _bench_result {
+  double ns_mean;          // Perform routine, per block
+  double ns_max;
+  double cpu_percent;      // Whole process, percent of one core
+  double dsp_allocs;       // Allocations on the DSP thread per block
+  double total_allocs;     // Allocations in the process per block
+  double packet_allocs;    // Allocations in the process per packet written
+  int renditions;          // Encoded packets per written packet
+  unsigned pool_misses;    // Frames or packets the pools could not supply
+  unsigned dropped_samples;
+  unsigned long long packets;
+} t_bench_result;
+
+static int bench_run(const char *url, const char *codec, const int *ladder,
+                     int ladder_size, int blocksize, int channels, t_float sr,
+                     double seconds, int realtime, t_bench_result *res) {
+  t_atom arg;
+  SETFLOAT(&arg, channels);
+  t_rtmpstreamer_tilde *x = (t_rtmpstreamer_tilde *)rtmpstreamer_tilde_new(
+      gensym("rtmpstreamer~"), 1, &arg);
+  if (!x)
+    return -1;
+
+  // The object keeps its codec if it rejects the name, and a codec without
+  // an encoder in this FFmpeg would only fail once the session starts
+  SETSYMBOL(&arg, gensym(codec));
+  pd_stub_send(x, "codec", 1, &arg);
+  if (strcmp(x->codec->name, codec) || !find_encoder(x->codec)) {
+    fprintf(stderr, "codec %s: not supported by this build\n", codec);
+    rtmpstreamer_tilde_free(x);
+    freebytes(x, sizeof(*x));
+    return -1;
+  }
+
+  // Every rendition encodes each frame, also those the output does not carry
+  if (ladder_size > 0) {
+    t_atom rates[RTMP_MAX_RENDITIONS];
+    for (int i = 0; i < ladder_size; i++)
+      SETFLOAT(&rates[i], ladder[i]);
+    pd_stub_send(x, "ladder", ladder_size, rates);
+  }
+  res->renditions = ladder_size > 0 ? ladder_size : 1;
+
+  // One input vector per channel, plus the signal outlet
+  t_signal signals[RTMP_MAX_CHANNELS + 1];
+  t_signal *sp[RTMP_MAX_CHANNELS + 1];
+  for (int ch = 0; ch <= channels; ch++) {
+    signals[ch].s_n = blocksize;
+    signals[ch].s_vec = (t_sample *)calloc(blocksize, sizeof(t_sample));
+    signals[ch].s_sr = sr;
+    sp[ch] = &signals[ch];
+  }
+  pd_stub_dsp_clear();
+  rtmpstreamer_tilde_dsp(x, sp);
+
+  SETSYMBOL(&arg, gensym(url));
+  pd_stub_send(x, "url", 1, &arg);
+
+  double block_ms = 1000.0 * blocksize / sr;
+  double phase = 0, step = BENCH_TWO_PI * 440.0 / sr;
+
+  // Wait for the connection; audio meanwhile goes to the pre-roll
+  int64_t deadline = now_ns() + BENCH_CONNECT_TIMEOUT_MS * 1000000LL;
+  while (!any_output_streaming(x->st) && now_ns() < deadline) {
+    pd_stub_dsp_tick();
+    pd_stub_advance(block_ms);
+    sleep_until_ns(now_ns() + (int64_t)(block_ms * 1e6));
+  }
+  if (!any_output_streaming(x->st)) {
+    fprintf(stderr, "could not connect to %s\n", url);
+    rtmpstreamer_tilde_free(x);
+    freebytes(x, sizeof(*x));
+    for (int ch = 0; ch <= channels; ch++)
+      free(signals[ch].s_vec);
+    return -1;
+  }
+
+  long blocks = (long)(seconds * sr / blocksize);
+  int64_t total_ns = 0, max_ns = 0;
+  unsigned long dsp_allocs = 0;
+  unsigned long allocs_before = process_allocs();
+  unsigned misses_before = atomic_load(&x->st->pool_misses);
+  unsigned long long packets_before = atomic_load(&x->st->packets_written);
+  int64_t cpu_before = cpu_time_ns();
+  int64_t wall_before = now_ns();
+
+  for (long i = 0; i < blocks; i++) {
+    // Synthesize the block outside the timed region
+    for (int s = 0; s < blocksize; s++) {
+      t_sample v = (t_sample)(0.5 * sin(phase));
+      for (int ch = 0; ch < channels; ch++)
+        signals[ch].s_vec[s] = v;
+      phase += step;
+      if (phase >= BENCH_TWO_PI)
+        phase -= BENCH_TWO_PI;
+    }
+
+    unsigned long allocs = dsp_thread_allocs();
+    int64_t start = now_ns();
+    pd_stub_dsp_tick();
+    int64_t elapsed = now_ns() - start;
+    dsp_allocs += dsp_thread_allocs() - allocs;
+
+    total_ns += elapsed;
+    if (elapsed > max_ns)
+      max_ns = elapsed;
+
+    pd_stub_advance(block_ms);
+    if (realtime)
+      sleep_until_ns(wall_before + (int64_t)((i + 1) * block_ms * 1e6));
+  }
+
+  int64_t wall = now_ns() - wall_before;
+  int64_t cpu = cpu_time_ns() - cpu_before;
+  unsigned long total_allocs = process_allocs() - allocs_before;
+  res->pool_misses = atomic_load(&x->st->pool_misses) - misses_before;
+  unsigned long long packets =
+      atomic_load(&x->st->packets_written) - packets_before;
+
+  res->ns_mean = blocks ? (double)total_ns / blocks : 0;
+  res->ns_max = (double)max_ns;
+  res->cpu_percent = wall ? 100.0 * cpu / wall : 0;
+  res->dsp_allocs = blocks ? (double)dsp_allocs / blocks : 0;
+  res->total_allocs = blocks ? (double)total_allocs / blocks : 0;
+  res->packet_allocs = packets ? (double)total_allocs / packets : 0;
+
+  // Stopping flushes the encoder and closes the output
+  stop_streaming(x);
+  res->dropped_samples = atomic_load(&x->st->dropped_samples);
+  res->packets = atomic_load(&x->st->packets_written);
+  rtmpstreamer_tilde_free(x);
+  freebytes(x, sizeof(*x));
+  for (int ch = 0; ch <= channels; ch++)
+    free(signals[ch].s_vec);
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: rtmpstreamer_bench [-o url] [-t seconds] [-r samplerate]\n"
+          "                          [-b blocksizes] [-c channels] "
+          "[-k codecs]\n"
+          "                          [-l ladder] [-f] [-v]\n");
+}
+
+int main(int argc, char **argv) {
+  const char *url = "/dev/null";
+  double seconds = 2;
+  t_float sr = 48000;
+  int blocksizes[BENCH_MAX_LIST] = {64, 256, 1024};
+  int num_blocksizes = 3;
+  int channel_counts[BENCH_MAX_LIST] = {1, 2, 8};
+  int num_channel_counts = 3;
+  char default_codecs[] = "aac";
+  char *codecs[BENCH_MAX_LIST];
+  int num_codecs = parse_name_list(default_codecs, codecs);
+  // Each configuration runs without a ladder, then with this one
+  int ladder[BENCH_MAX_LIST] = {128, 64, 32};
+  int ladder_size = 3;
+  int realtime = 1;
+  int verbose = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *opt = argv[i];
+    if (!strcmp(opt, "-f")) {
+      realtime = 0;
+    } else if (!strcmp(opt, "-v")) {
+      verbose = 1;
+    } else if (i + 1 < argc && !strcmp(opt, "-o")) {
+      url = argv[++i];
+    } else if (i + 1 < argc && !strcmp(opt, "-t")) {
+      seconds = atof(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-r")) {
+      sr = (t_float)atof(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-b")) {
+      num_blocksizes = parse_int_list(argv[++i], blocksizes);
+    } else if (i + 1 < argc && !strcmp(opt, "-c")) {
+      num_channel_counts = parse_int_list(argv[++i], channel_counts);
+    } else if (i + 1 < argc && !strcmp(opt, "-k")) {
+      num_codecs = parse_name_list(argv[++i], codecs);
+    } else if (i + 1 < argc && !strcmp(opt, "-l")) {
+      const char *arg = argv[++i];
+      ladder_size = strcmp(arg, "off") ? parse_int_list(arg, ladder) : 0;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (num_blocksizes <= 0 || num_channel_counts <= 0 || num_codecs <= 0 ||
+      ladder_size < 0 || ladder_size > RTMP_MAX_RENDITIONS || seconds <= 0 ||
+      sr <= 0) {
+    usage();
+    return 2;
+  }
+
+  pd_stub_set_verbose(verbose);
+  pd_stub_set_samplerate(sr);
+  rtmpstreamer_tilde_setup();
+
+  printf("# %s, %g Hz, %g s per run, %s, allocations: %s\n", url, sr, seconds,
+         realtime ? "real time" : "unpaced",
+         BENCH_COUNT_ALLOCS ? "all" : "getbytes only");
+  printf("%-6s %6s %3s %6s %12s %12s %7s %10s %12s %11s %9s %9s %9s\n",
+         "codec", "block", "ch", "ladder", "ns/block", "max ns", "cpu %",
+         "dsp alloc", "allocs/block", "allocs/pkt", "pool miss", "dropped",
+         "packets");
+
+  int failed = 0;
+  for (int k = 0; k < num_codecs; k++) {
+    for (int c = 0; c < num_channel_counts; c++) {
+      for (int b = 0; b < num_blocksizes; b++) {
+        for (int l = 0; l <= (ladder_size > 0); l++) {
+          t_bench_result res;
+          if (bench_run(url, codecs[k], ladder, l ? ladder_size : 0,
+                        blocksizes[b], channel_counts[c], sr, seconds,
+                        realtime, &res) < 0) {
+            failed = 1;
+            continue;
+          }
+          printf("%-6s %6d %3d %6d %12.1f %12.0f %7.1f %10.2f %12.2f %11.2f "
+                 "%9u %9u %9llu\n",
+                 codecs[k], blocksizes[b], channel_counts[c],
+                 l ? ladder_size : 0, res.ns_mean, res.ns_max,
+                 res.cpu_percent, res.dsp_allocs, res.total_allocs,
+                 res.packet_allocs, res.pool_misses, res.dropped_samples,
+                 res.packets);
+          fflush(stdout);
+          if (res.dsp_allocs > 0 || res.pool_misses > 0) {
+            fprintf(stderr, "%s, block %d, %d ch, ladder %d: steady state "
+                            "allocated\n",
+                    codecs[k], blocksizes[b], channel_counts[c],
+                    l ? ladder_size : 0);
+            failed = 1;
+          }
+          // Every rendition encodes each frame, but only one is written
+          int allowed =
+              res.renditions * (channel_counts[c] + BENCH_ALLOCS_PER_PACKET);
+          if (BENCH_COUNT_ALLOCS && res.packet_allocs > allowed) {
+            fprintf(stderr, "%s, block %d, %d ch, ladder %d: %.2f "
+                            "allocations per packet, at most %d expected\n",
+                    codecs[k], blocksizes[b], channel_counts[c],
+                    l ? ladder_size : 0, res.packet_allocs, allowed);
+            failed = 1;
+          }
+        }
+      }
+    }
+  }
+  return failed;
+}
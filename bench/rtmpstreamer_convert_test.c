@@ -0,0 +1,99 @@
+// rtmpstreamer_convert_test.c
+//
+// Checks the frame converters with samples beyond full scale, as the
+// resampler can produce. Every integer sample format is fed mono, stereo and
+// wider layouts holding values above 1.0 and below -1.0, once with the scalar
+// kernels and once with the kernels the CPU selects. Out of range samples
+// must come out at full scale, never wrapped or INT_MIN.
+//
+// Usage: rtmpstreamer_convert_test
+
+#define _POSIX_C_SOURCE 200809L
+
+// The external is compiled into the test so its kernels can be called
+// directly
+#include "rtmpstreamer~.c"
+
+#include <stdlib.h>
+
+// Odd, so every kernel also runs its scalar tail
+#define TEST_FRAMES 203
+
+static const enum AVSampleFormat test_formats[] = {
+    AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S32,
+    AV_SAMPLE_FMT_S32P};
+static const int test_channels[] = {1, 2, 3, RTMP_MAX_CHANNELS};
+
+// Input sample i of channel ch: a sweep from -4 to 4 with exact full scale
+// and values just past it mixed in
+static float test_sample(int ch, int i) {
+  static const float edges[] = {1.0f, -1.0f, 1.0001f, -1.0001f,
+                                1e9f, -1e9f, 0.5f,    -0.5f};
+  if (i % 3 == 0)
+    return edges[(i / 3 + ch) % 8];
+  return -4.0f + 8.0f * (float)i / TEST_FRAMES;
+}
+
+static double expected(float sample, double scale) {
+  sample = sample < -1.0f ? -1.0f : sample;
+  sample = sample > 1.0f ? 1.0f : sample;
+  return lrintf(sample * (float)scale);
+}
+
+static int check_format(enum AVSampleFormat fmt, int channels,
+                        const char *kernels) {
+  int supported;
+  t_frame_converter convert = select_frame_converter(fmt, &supported);
+  int planar = av_sample_fmt_is_planar(fmt);
+  int bytes = av_get_bytes_per_sample(fmt);
+  double scale = bytes == 2 ? RTMP_S16_SCALE : RTMP_S32_SCALE;
+
+  float planes[RTMP_MAX_CHANNELS][TEST_FRAMES];
+  float *src[RTMP_MAX_CHANNELS];
+  for (int ch = 0; ch < channels; ch++) {
+    for (int i = 0; i < TEST_FRAMES; i++)
+      planes[ch][i] = test_sample(ch, i);
+    src[ch] = planes[ch];
+  }
+
+  uint8_t *out = (uint8_t *)calloc((size_t)channels * TEST_FRAMES, bytes);
+  uint8_t *dst[RTMP_MAX_CHANNELS];
+  for (int ch = 0; ch < channels; ch++)
+    dst[ch] = planar ? out + (size_t)ch * TEST_FRAMES * bytes : out;
+  convert(dst, src, channels, TEST_FRAMES);
+
+  int failures = 0;
+  for (int ch = 0; ch < channels; ch++) {
+    for (int i = 0; i < TEST_FRAMES; i++) {
+      size_t index = planar ? (size_t)ch * TEST_FRAMES + i
+                            : (size_t)i * channels + ch;
+      double got = bytes == 2 ? ((int16_t *)out)[index]
+                              : ((int32_t *)out)[index];
+      double want = expected(planes[ch][i], scale);
+      if (got != want && failures++ < 4)
+        fprintf(stderr, "%s %s %d ch: sample %d of channel %d is %.0f, "
+                        "expected %.0f (input %g)\n",
+                kernels, av_get_sample_fmt_name(fmt), channels, i, ch, got,
+                want, planes[ch][i]);
+    }
+  }
+  free(out);
+  return failures;
+}
+
+static int check_all(const char *kernels) {
+  int failures = 0;
+  for (size_t f = 0; f < sizeof(test_formats) / sizeof(*test_formats); f++)
+    for (size_t c = 0; c < sizeof(test_channels) / sizeof(*test_channels); c++)
+      failures += check_format(test_formats[f], test_channels[c], kernels);
+  return failures;
+}
+
+int main(void) {
+  int failures = check_all("scalar");
+  const char *name = select_sample_kernels();
+  failures += check_all(name);
+  printf("frame converters (scalar, %s): %s\n", name,
+         failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,307 @@
+// rtmpstreamer_sink_bench.c
+//
+// End-to-end benchmark for rtmpstreamer~. Starts the local FLV-over-TCP sink
+// (flv_sink.c), connects one or more rtmpstreamer~ objects to it, and feeds
+// synthetic audio through their perform routines in real time, as Pd would.
+//
+// Reports the latency from submitting a sample in the perform routine to the
+// arrival of the packet that carries it (mean, p50, p99, max), sustained
+// throughput, and process CPU use. With -n in the hundreds it shows how the
+// encoder and writer threads scale with many concurrent streams.
+//
+// Usage: rtmpstreamer_sink_bench [-n streams] [-t seconds] [-r samplerate]
+//                                [-b blocksize] [-c channels] [-k codec] [-v]
+
+#define _POSIX_C_SOURCE 200809L
+
+// The external is compiled into the benchmark so its internals (streaming
+// state, counters) can be inspected directly
+#include "rtmpstreamer~.c"
+
+#include "flv_sink.h"
+#include "pd_stub.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#define BENCH_CONNECT_TIMEOUT_MS 10000
+#define BENCH_DRAIN_TIMEOUT_MS 5000
+#define BENCH_MAX_LATENCIES (1 << 22)
+
+// Shared between the Pd thread (producer) and the sink thread
+typedef struct _latency_probe {
+  int64_t *submit_ns;      // Time each block was submitted, by block index
+  long max_blocks;
+  atomic_long submitted;   // Blocks whose submit time is valid
+  int blocksize;
+  double sr;
+  int lead_samples;        // Samples after a packet's timestamp it depends on
+  int64_t *latencies;      // Sink thread only
+  long num_latencies;
+  long unmatched;          // Tags that could not be mapped to a block
+} t_latency_probe;
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t cpu_time_ns(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+         ((int64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static void sleep_until_ns(int64_t deadline) {
+  int64_t wait = deadline - now_ns();
+  if (wait <= 0)
+    return;
+  struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+  nanosleep(&ts, NULL);
+}
+
+// Send "stop" and keep Pd's clock going until the session has flushed the
+// encoder and closed its outputs in the background
+static void stop_streaming(t_rtmpstreamer_tilde *x) {
+  pd_stub_send(x, "stop", 0, NULL);
+  while (x->worker_running) {
+    pd_stub_advance(RTMP_TICK_MS);
+    sleep_until_ns(now_ns() + RTMP_TICK_MS * 1000000LL);
+  }
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Sink callback: match an audio tag to the block that completed it
+static void on_audio(void *ctx, int conn, int64_t timestamp,
+                     int64_t arrival_ns, int size) {
+  t_latency_probe *probe = (t_latency_probe *)ctx;
+  int64_t last_sample =
+      (int64_t)(timestamp * probe->sr / 1000.0) + probe->lead_samples - 1;
+  long block = last_sample < 0 ? 0 : (long)(last_sample / probe->blocksize);
+  if (block >= atomic_load_explicit(&probe->submitted, memory_order_acquire) ||
+      probe->num_latencies == BENCH_MAX_LATENCIES) {
+    probe->unmatched++;
+    return;
+  }
+  probe->latencies[probe->num_latencies++] =
+      arrival_ns - probe->submit_ns[block];
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: rtmpstreamer_sink_bench [-n streams] [-t seconds] "
+                  "[-r samplerate]\n"
+                  "                               [-b blocksize] "
+                  "[-c channels] [-k codec] [-v]\n");
+}
+
+int main(int argc, char **argv) {
+  int streams = 1;
+  double seconds = 5;
+  t_float sr = 48000;
+  int blocksize = 64;
+  int channels = 2;
+  const char *codec = "aac";
+  int verbose = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *opt = argv[i];
+    if (!strcmp(opt, "-v")) {
+      verbose = 1;
+    } else if (i + 1 < argc && !strcmp(opt, "-n")) {
+      streams = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-t")) {
+      seconds = atof(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-r")) {
+      sr = (t_float)atof(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-b")) {
+      blocksize = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-c")) {
+      channels = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(opt, "-k")) {
+      codec = argv[++i];
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (streams <= 0 || seconds <= 0 || sr <= 0 || blocksize <= 0 ||
+      channels < 1 || channels > RTMP_MAX_CHANNELS) {
+    usage();
+    return 2;
+  }
+
+  pd_stub_set_verbose(verbose);
+  pd_stub_set_samplerate(sr);
+  rtmpstreamer_tilde_setup();
+
+  // Every block's submit time, including the time spent connecting
+  t_latency_probe probe;
+  memset(&probe, 0, sizeof(probe));
+  probe.max_blocks =
+      (long)((seconds + BENCH_CONNECT_TIMEOUT_MS / 1000.0) * sr / blocksize) + 1;
+  probe.submit_ns = (int64_t *)calloc(probe.max_blocks, sizeof(int64_t));
+  probe.latencies = (int64_t *)calloc(BENCH_MAX_LATENCIES, sizeof(int64_t));
+  atomic_init(&probe.submitted, 0);
+  probe.blocksize = blocksize;
+  probe.sr = sr;
+
+  t_flv_sink *sink = flv_sink_start(streams, on_audio, &probe);
+  if (!sink) {
+    fprintf(stderr, "could not start the sink\n");
+    return 1;
+  }
+  char url[64];
+  snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", flv_sink_port(sink));
+
+  // All objects share one DSP chain and one set of input vectors, so every
+  // stream sees the same block at the same time
+  t_signal signals[RTMP_MAX_CHANNELS + 1];
+  t_signal *sp[RTMP_MAX_CHANNELS + 1];
+  for (int ch = 0; ch <= channels; ch++) {
+    signals[ch].s_n = blocksize;
+    signals[ch].s_vec = (t_sample *)calloc(blocksize, sizeof(t_sample));
+    signals[ch].s_sr = sr;
+    sp[ch] = &signals[ch];
+  }
+
+  t_rtmpstreamer_tilde **objects =
+      (t_rtmpstreamer_tilde **)calloc(streams, sizeof(*objects));
+  pd_stub_dsp_clear();
+  for (int i = 0; i < streams; i++) {
+    t_atom arg;
+    SETFLOAT(&arg, channels);
+    objects[i] = (t_rtmpstreamer_tilde *)rtmpstreamer_tilde_new(
+        gensym("rtmpstreamer~"), 1, &arg);
+    if (!objects[i]) {
+      fprintf(stderr, "could not create object %d\n", i);
+      return 1;
+    }
+    if (strcmp(codec, "aac")) {
+      SETSYMBOL(&arg, gensym(codec));
+      if (pd_stub_send(objects[i], "codec", 1, &arg) < 0) {
+        fprintf(stderr, "codec %s: not supported by this build\n", codec);
+        return 1;
+      }
+    }
+    rtmpstreamer_tilde_dsp(objects[i], sp);
+  }
+
+  double block_ms = 1000.0 * blocksize / sr;
+  double phase = 0, step = 440.0 / sr;
+  long total_blocks = (long)(seconds * sr / blocksize);
+  int64_t cpu_before = cpu_time_ns();
+  int64_t start = now_ns();
+
+  // Streaming starts with the block after the url message, at sample 0
+  for (int i = 0; i < streams; i++) {
+    t_atom arg;
+    SETSYMBOL(&arg, gensym(url));
+    pd_stub_send(objects[i], "url", 1, &arg);
+  }
+
+  int connected = 0;
+  int64_t connect_deadline = start + BENCH_CONNECT_TIMEOUT_MS * 1000000LL;
+  int64_t connect_ns = 0;
+  long block = 0;
+  for (;; block++) {
+    if (!connected) {
+      int all = 1;
+      for (int i = 0; i < streams && all; i++)
+        all = any_output_streaming(objects[i]->st);
+      if (all) {
+        connected = 1;
+        connect_ns = now_ns() - start;
+        total_blocks += block; // Measure for seconds after connecting
+        if (total_blocks > probe.max_blocks)
+          total_blocks = probe.max_blocks;
+        // The encoder is open now; its delay is fixed for the session
+        t_streamer *st = objects[0]->st;
+        probe.lead_samples =
+            st->codec_ctx ? st->frame_capacity + st->codec_ctx->initial_padding
+                          : st->frame_capacity;
+      } else if (now_ns() >= connect_deadline || block >= probe.max_blocks) {
+        fprintf(stderr, "not every stream connected to %s\n", url);
+        break;
+      }
+    }
+    if (connected && block >= total_blocks)
+      break;
+
+    // Square wave at 440 Hz, cheap enough not to skew the timing
+    for (int s = 0; s < blocksize; s++) {
+      t_sample v = phase < 0.5 ? 0.25f : -0.25f;
+      for (int ch = 0; ch < channels; ch++)
+        signals[ch].s_vec[s] = v;
+      phase += step;
+      if (phase >= 1)
+        phase -= 1;
+    }
+
+    probe.submit_ns[block] = now_ns();
+    atomic_store_explicit(&probe.submitted, block + 1, memory_order_release);
+    pd_stub_dsp_tick();
+    pd_stub_advance(block_ms);
+    sleep_until_ns(start + (int64_t)((block + 1) * block_ms * 1e6));
+  }
+  int64_t wall = now_ns() - start;
+
+  // Stopping flushes every encoder and closes the connections
+  unsigned dropped_samples = 0;
+  unsigned reconnects = 0;
+  for (int i = 0; i < streams; i++) {
+    t_rtmpstreamer_tilde *x = objects[i];
+    stop_streaming(x);
+    dropped_samples += atomic_load(&x->st->dropped_samples);
+    reconnects += atomic_load(&x->st->reconnects);
+    rtmpstreamer_tilde_free(x);
+    freebytes(x, sizeof(*x));
+  }
+  int64_t cpu = cpu_time_ns() - cpu_before;
+
+  t_flv_sink_stats stats;
+  flv_sink_stop(sink, BENCH_DRAIN_TIMEOUT_MS, &stats);
+
+  printf("# %d stream(s) to %s, %s, %d ch, block %d, %g Hz, %.1f s\n", streams,
+         url, codec, channels, blocksize, sr, wall / 1e9);
+  printf("connected      %d/%d in %.1f ms, %d malformed\n", stats.connections,
+         streams, connect_ns / 1e6, stats.errors);
+  double span = stats.last_byte_ns > stats.first_byte_ns
+                    ? (stats.last_byte_ns - stats.first_byte_ns) / 1e9
+                    : 0;
+  printf("throughput     %.1f kbit/s total, %.1f kbit/s per stream\n",
+         span ? stats.bytes * 8 / span / 1000 : 0,
+         span ? stats.bytes * 8 / span / 1000 / streams : 0);
+  printf("received       %llu bytes, %llu audio packets\n",
+         (unsigned long long)stats.bytes,
+         (unsigned long long)stats.audio_tags);
+  if (probe.num_latencies > 0) {
+    qsort(probe.latencies, probe.num_latencies, sizeof(int64_t),
+          compare_int64);
+    double sum = 0;
+    for (long i = 0; i < probe.num_latencies; i++)
+      sum += probe.latencies[i];
+    printf("latency ms     mean %.2f  p50 %.2f  p99 %.2f  max %.2f "
+           "(%ld packets, %ld unmatched)\n",
+           sum / probe.num_latencies / 1e6,
+           probe.latencies[probe.num_latencies / 2] / 1e6,
+           probe.latencies[(long)(probe.num_latencies * 0.99)] / 1e6,
+           probe.latencies[probe.num_latencies - 1] / 1e6,
+           probe.num_latencies, probe.unmatched);
+  }
+  printf("cpu            %.1f%% of one core\n", wall ? 100.0 * cpu / wall : 0);
+  printf("dropped        %u samples, %u reconnects\n", dropped_samples,
+         reconnects);
+
+  for (int ch = 0; ch <= channels; ch++)
+    free(signals[ch].s_vec);
+  free(objects);
+  free(probe.submit_ns);
+  free(probe.latencies);
+  return connected ? 0 : 1;
+}
@@ -3,156 +3,3498 @@
 // A Pure Data external that streams audio via RTMP to a remote server.
 //
 // This external takes audio input and a URL string, and streams the audio to
-// the RTMP server. If no URL is provided, it operates in a non-streaming mode
-// without crashing.
+// the RTMP server. The URL scheme picks the transport: rtmp:// (flv),
+// rtsp://, srt:// and udp:// (MPEG-TS), icecast://, or a file path. If no
+// URL is provided, it operates in a non-streaming mode without crashing.
 //
 // Dependencies:
-// - FFmpeg libraries (libavformat, libavcodec, libavutil)
+// - FFmpeg libraries (libavformat, libavcodec, libavutil, libswresample)
+//
+// Encoding runs on a worker pool shared by every object in the process and
+// sized to the number of cores. Connecting and writing run on a second pool
+// that adds threads only while every one is blocked in a call, and every such
+// call has a deadline, so a stalled server never holds up an encoder. The
+// DSP perform routine only copies samples into a lock-free ring buffer, so a
+// slow RTMP server can never stall Pd's audio callback. Connection setup
+// (DNS, socket, RTMP handshake) also happens in the background, so changing
+// the URL never blocks the Pd scheduler. Stopping does not wait either: a
+// session keeps the streaming state it works on alive, flushes and
+// disconnects on its own and reports back when it is done, even after the
+// object is gone. State changes are reported on the right outlet as
+// "state idle|connecting|streaming|reconnecting|error <url>".
+//
+// When the connection drops the worker tears the session down and reconnects
+// with exponential backoff. Meanwhile the last few seconds of audio are kept
+// in a pre-roll buffer and sent first once the stream is back.
+//
+// The audio is encoded once and can be sent to several RTMP destinations.
+// Each output has its own writer task, packet queue and connection state,
+// so a slow or failing server does not hold up the others.
+//
+// If Pd's sample rate changes while streaming, the stream keeps its rate:
+// the worker swaps the resampler at the first sample at the new rate, and the
+// encoder and connections stay open.
 //
 // Build with CMake and make.
 //
 // Author: Tony Rewin
 // Date: 16.09.2024
 
-#include "m_pd.h"
-#include <stdio.h>
-#include <string.h>
+#define _POSIX_C_SOURCE 200809L
+
+#include "m_pd.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Include FFmpeg headers
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avassert.h>
+#include <libavutil/buffer.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/time.h>
+#include <libswresample/swresample.h>
+
+// FFmpeg before 6.1 only has the FF_ spelling
+#ifndef AV_PROFILE_AAC_LD
+#define AV_PROFILE_AAC_LD FF_PROFILE_AAC_LD
+#endif
+
+// SIMD support for the sample kernels. AVX2 is compiled in on any GCC/Clang
+// x86 build and only used if the CPU reports it at runtime.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RTMP_HAVE_AVX2 1
+#else
+#define RTMP_HAVE_AVX2 0
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define RTMP_HAVE_NEON 1
+#else
+#define RTMP_HAVE_NEON 0
+#endif
+// The clamp kernels need t_sample to be float (Pd built without double
+// precision); otherwise the scalar loop is used
+#if !defined(PD_FLOATSIZE) || PD_FLOATSIZE == 32
+#define RTMP_FLOAT_SAMPLES 1
+#else
+#define RTMP_FLOAT_SAMPLES 0
+#endif
+
+// Maximum number of signal inlets / encoded channels
+#define RTMP_MAX_CHANNELS 8
+// Seconds of audio the DSP-to-worker ring buffer can hold
+#define RTMP_RING_SECONDS 2
+// How long the worker sleeps when the ring buffer runs dry
+#define RTMP_WORKER_POLL_MS 5
+// Low-latency mode: shorter worker sleeps and encoder frames
+#define RTMP_LOW_LATENCY_POLL_MS 1
+#define RTMP_LOW_LATENCY_FRAME_MS 5
+// Interval of the Pd-side clock that reports worker state and errors
+#define RTMP_TICK_MS 100
+// How long a stopping worker may spend flushing before I/O is interrupted
+#define RTMP_STOP_TIMEOUT_MS 2000
+// Reconnect backoff bounds, doubled after every failed attempt
+#define RTMP_RECONNECT_MIN_MS 500
+#define RTMP_RECONNECT_MAX_MS 30000
+// Encoded packets each output can queue before the overflow policy applies
+#define RTMP_OUTPUT_QUEUE_PACKETS 64
+// Maximum number of destinations per object
+#define RTMP_MAX_OUTPUTS 8
+// Samples per channel fed to the resampler at a time
+#define RTMP_RESAMPLE_CHUNK 1024
+// Default seconds of audio kept while reconnecting
+#define RTMP_DEFAULT_PREROLL_SECONDS 5
+// Seconds of decoded audio the stream monitor can buffer
+#define RTMP_MONITOR_SECONDS 1
+// Default length of one archive file
+#define RTMP_DEFAULT_SEGMENT_SECONDS 600
+// Bounds of the encode pool, which is otherwise sized to the cores
+#define RTMP_POOL_MIN_THREADS 2
+#define RTMP_POOL_MAX_THREADS 64
+// Threads the I/O pool grows to at most; past that, writers share them
+#define RTMP_IO_POOL_MAX_THREADS 512
+// Idle time after which an I/O thread beyond the core count exits
+#define RTMP_IO_POOL_IDLE_MS 10000
+// Longest a writer may block in one connection attempt, and in one write or
+// the closing of a stream, before the call is interrupted
+#define RTMP_CONNECT_TIMEOUT_MS 10000
+#define RTMP_WRITE_TIMEOUT_MS 5000
+// Preallocated encoder input frames per session, enough for the encoder to
+// hold on to one while the next is being filled
+#define RTMP_FRAME_POOL 3
+// Bytes an encoded packet may have beyond the raw samples of its frame
+// (headers, or a lossless frame stored verbatim) and still come from the
+// session's packet buffers
+#define RTMP_PACKET_BUFFER_SLACK 1024
+// Adaptive bitrate: encoders at halving rates run side by side, and each
+// network output is fed from the one its connection keeps up with
+#define RTMP_ABR_RUNGS 3
+// How often adaptive bitrate re-evaluates each output
+#define RTMP_ABR_INTERVAL_MS 1000
+// Queued packets above which an output steps down, and at most which it
+// counts as calm; an output steps up after a run of calm intervals
+#define RTMP_ABR_HIGH_WATER (RTMP_OUTPUT_QUEUE_PACKETS / 4)
+#define RTMP_ABR_LOW_WATER 2
+#define RTMP_ABR_CALM_INTERVALS 5
+// Encodings of one stream at different bitrates (ladder)
+#define RTMP_MAX_RENDITIONS 4
+// Slots of the command and reply queues between Pd and the worker tasks
+#define RTMP_MESSAGE_SLOTS 32
+
+// Steps of the streaming worker task
+typedef enum _worker_phase {
+  WORKER_SETUP,   // Open the encoder and start the writers
+  WORKER_RUNNING, // Encode and dispatch until told to stop
+  WORKER_STOPPING // Wait for the writers to finish, then clean up
+} t_worker_phase;
+
+// Connection state, owned by the streaming worker
+typedef enum _stream_state {
+  STREAM_IDLE = 0,   // No session
+  STREAM_CONNECTING, // Worker is opening the URL and writing the header
+  STREAM_STREAMING,  // Audio is being encoded and sent
+  STREAM_RECONNECTING, // Waiting to retry after a failure
+  STREAM_ERROR       // Connection failed and reconnecting is disabled
+} t_stream_state;
+
+static const char *stream_state_names[] = {"idle", "connecting", "streaming",
+                                           "reconnecting", "error"};
+
+// What the encoder does when an output's packet queue is full
+typedef enum _queue_policy {
+  QUEUE_DROP_OLDEST = 0, // Discard the oldest queued packet (default)
+  QUEUE_DROP_NEWEST,     // Discard the packet being queued
+  QUEUE_BLOCK            // Wait for the writer; the ring buffer absorbs it
+} t_queue_policy;
+
+static const char *queue_policy_names[] = {"drop-oldest", "drop-newest",
+                                           "block"};
+
+// What the signal outlet plays
+typedef enum _monitor_mode {
+  MONITOR_INPUT = 0, // The input, mixed to mono (default)
+  MONITOR_STREAM,    // The encoded stream, decoded again on the worker
+  MONITOR_OFF        // Silence
+} t_monitor_mode;
+
+static const char *monitor_mode_names[] = {"input", "stream", "off"};
+
+// What the stream carries while paused. Either way the connections stay up
+// and the timestamps simply continue on resume.
+typedef enum _pause_mode {
+  PAUSE_OFF,                 // Not paused
+  PAUSE_SILENCE,             // Silent frames, so servers keep getting data
+  PAUSE_NOTHING              // No packets; the input is discarded
+} t_pause_mode;
+
+static const char *pause_mode_names[] = {"off", "silence", "nothing"};
+
+// Progress of a rendition's share of the current frame
+typedef enum _rendition_job {
+  JOB_IDLE,                  // Nothing to encode
+  JOB_READY,                 // Frame handed over, not picked up yet
+  JOB_CLAIMED,               // Being encoded by its task or the encoder task
+  JOB_DONE                   // Encoded and dispatched
+} t_rendition_job;
+
+// Sample kernels
+//
+// The DSP thread clamps every block into the ring buffer, and the worker may
+// convert accumulated frames to the encoder's sample format. Both loops run
+// through function pointers chosen once: the clamp kernel by CPU features in
+// rtmpstreamer_tilde_setup, the frame converter by sample format in
+// initialize_streaming.
+
+// Integer conversions clamp to [-1.0, 1.0] before scaling: the DSP input is
+// clamped, but the resampler can overshoot full scale, and an out of range
+// sample would otherwise wrap (lrintf) or turn into INT_MIN (cvtps).
+// Largest float below 2^31, so full scale never overflows int32
+#define RTMP_S32_SCALE 2147483520.0f
+#define RTMP_S16_SCALE 32767.0f
+// Samples per channel converted at a time for layouts wider than stereo
+#define RTMP_CONVERT_CHUNK 256
+
+typedef void (*t_clamp_kernel)(float *dst, const t_sample *src, size_t n);
+typedef void (*t_s16_kernel)(int16_t *dst, const float *src, size_t n);
+typedef void (*t_s32_kernel)(int32_t *dst, const float *src, size_t n);
+// Stereo kernels convert two planes and interleave them in one pass
+typedef void (*t_s16_stereo_kernel)(int16_t *dst, const float *l,
+                                    const float *r, size_t n);
+typedef void (*t_s32_stereo_kernel)(int32_t *dst, const float *l,
+                                    const float *r, size_t n);
+typedef void (*t_flt_stereo_kernel)(float *dst, const float *l, const float *r,
+                                    size_t n);
+
+static void clamp_copy_scalar(float *dst, const t_sample *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    float sample = src[i];
+    // Clamp the sample to [-1.0, 1.0]
+    sample = sample < -1.0f ? -1.0f : sample;
+    sample = sample > 1.0f ? 1.0f : sample;
+    dst[i] = sample;
+  }
+}
+
+static inline float clamp_sample(float sample) {
+  sample = sample < -1.0f ? -1.0f : sample;
+  return sample > 1.0f ? 1.0f : sample;
+}
+
+static inline int16_t s16_sample(float sample) {
+  return (int16_t)lrintf(clamp_sample(sample) * RTMP_S16_SCALE);
+}
+
+static inline int32_t s32_sample(float sample) {
+  return (int32_t)lrintf(clamp_sample(sample) * RTMP_S32_SCALE);
+}
+
+static void to_s16_scalar(int16_t *dst, const float *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = s16_sample(src[i]);
+}
+
+static void to_s32_scalar(int32_t *dst, const float *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = s32_sample(src[i]);
+}
+
+static void to_s16_stereo_scalar(int16_t *dst, const float *l, const float *r,
+                                 size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[2 * i] = s16_sample(l[i]);
+    dst[2 * i + 1] = s16_sample(r[i]);
+  }
+}
+
+static void to_s32_stereo_scalar(int32_t *dst, const float *l, const float *r,
+                                 size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[2 * i] = s32_sample(l[i]);
+    dst[2 * i + 1] = s32_sample(r[i]);
+  }
+}
+
+static void to_flt_stereo_scalar(float *dst, const float *l, const float *r,
+                                 size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[2 * i] = l[i];
+    dst[2 * i + 1] = r[i];
+  }
+}
+
+#if RTMP_FLOAT_SAMPLES && defined(__SSE2__)
+static void clamp_copy_sse2(float *dst, const t_sample *src, size_t n) {
+  const __m128 lo = _mm_set1_ps(-1.0f), hi = _mm_set1_ps(1.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(dst + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), lo), hi));
+  clamp_copy_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+#ifdef __SSE2__
+// Four samples clamped, scaled and rounded to int32
+static inline __m128i scale_sse2(const float *src, __m128 scale) {
+  __m128 sample = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src), _mm_set1_ps(-1.0f)),
+                             _mm_set1_ps(1.0f));
+  return _mm_cvtps_epi32(_mm_mul_ps(sample, scale));
+}
+
+static void to_s16_sse2(int16_t *dst, const float *src, size_t n) {
+  const __m128 scale = _mm_set1_ps(RTMP_S16_SCALE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = scale_sse2(src + i, scale);
+    __m128i b = scale_sse2(src + i + 4, scale);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+  }
+  to_s16_scalar(dst + i, src + i, n - i);
+}
+
+static void to_s32_sse2(int32_t *dst, const float *src, size_t n) {
+  const __m128 scale = _mm_set1_ps(RTMP_S32_SCALE);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i *)(dst + i), scale_sse2(src + i, scale));
+  to_s32_scalar(dst + i, src + i, n - i);
+}
+
+static void to_s16_stereo_sse2(int16_t *dst, const float *l, const float *r,
+                               size_t n) {
+  const __m128 scale = _mm_set1_ps(RTMP_S16_SCALE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i left = _mm_packs_epi32(scale_sse2(l + i, scale),
+                                   scale_sse2(l + i + 4, scale));
+    __m128i right = _mm_packs_epi32(scale_sse2(r + i, scale),
+                                    scale_sse2(r + i + 4, scale));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(left, right));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 8),
+                     _mm_unpackhi_epi16(left, right));
+  }
+  to_s16_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+
+static void to_s32_stereo_sse2(int32_t *dst, const float *l, const float *r,
+                               size_t n) {
+  const __m128 scale = _mm_set1_ps(RTMP_S32_SCALE);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i left = scale_sse2(l + i, scale), right = scale_sse2(r + i, scale);
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(left, right));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 4),
+                     _mm_unpackhi_epi32(left, right));
+  }
+  to_s32_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+
+static void to_flt_stereo_sse2(float *dst, const float *l, const float *r,
+                               size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 left = _mm_loadu_ps(l + i), right = _mm_loadu_ps(r + i);
+    _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(left, right));
+    _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(left, right));
+  }
+  to_flt_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+#endif
+
+#if RTMP_HAVE_AVX2
+#if RTMP_FLOAT_SAMPLES
+__attribute__((target("avx2"))) static void
+clamp_copy_avx2(float *dst, const t_sample *src, size_t n) {
+  const __m256 lo = _mm256_set1_ps(-1.0f), hi = _mm256_set1_ps(1.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(
+        dst + i, _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + i), lo), hi));
+  clamp_copy_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+// Eight samples clamped, scaled and rounded to int32
+__attribute__((target("avx2"))) static inline __m256i
+scale_avx2(const float *src, __m256 scale) {
+  __m256 sample = _mm256_min_ps(
+      _mm256_max_ps(_mm256_loadu_ps(src), _mm256_set1_ps(-1.0f)),
+      _mm256_set1_ps(1.0f));
+  return _mm256_cvtps_epi32(_mm256_mul_ps(sample, scale));
+}
+
+__attribute__((target("avx2"))) static void
+to_s16_avx2(int16_t *dst, const float *src, size_t n) {
+  const __m256 scale = _mm256_set1_ps(RTMP_S16_SCALE);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i a = scale_avx2(src + i, scale);
+    __m256i b = scale_avx2(src + i + 8, scale);
+    // packs works per 128-bit lane; restore sample order afterwards
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    _mm256_storeu_si256((__m256i *)(dst + i), packed);
+  }
+  to_s16_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+to_s32_avx2(int32_t *dst, const float *src, size_t n) {
+  const __m256 scale = _mm256_set1_ps(RTMP_S32_SCALE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i *)(dst + i), scale_avx2(src + i, scale));
+  to_s32_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+to_s16_stereo_avx2(int16_t *dst, const float *l, const float *r, size_t n) {
+  const __m256 scale = _mm256_set1_ps(RTMP_S16_SCALE);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // Lane-wise packs leave samples 0-3 and 8-11 in the low lane and 4-7 and
+    // 12-15 in the high lane, so the lane-wise unpacks come out in order
+    __m256i left = _mm256_packs_epi32(scale_avx2(l + i, scale),
+                                      scale_avx2(l + i + 8, scale));
+    __m256i right = _mm256_packs_epi32(scale_avx2(r + i, scale),
+                                       scale_avx2(r + i + 8, scale));
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i),
+                        _mm256_unpacklo_epi16(left, right));
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i + 16),
+                        _mm256_unpackhi_epi16(left, right));
+  }
+  to_s16_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+to_s32_stereo_avx2(int32_t *dst, const float *l, const float *r, size_t n) {
+  const __m256 scale = _mm256_set1_ps(RTMP_S32_SCALE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i left = scale_avx2(l + i, scale), right = scale_avx2(r + i, scale);
+    __m256i lo = _mm256_unpacklo_epi32(left, right);
+    __m256i hi = _mm256_unpackhi_epi32(left, right);
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i + 8),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  to_s32_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+to_flt_stereo_avx2(float *dst, const float *l, const float *r, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 left = _mm256_loadu_ps(l + i), right = _mm256_loadu_ps(r + i);
+    __m256 lo = _mm256_unpacklo_ps(left, right);
+    __m256 hi = _mm256_unpackhi_ps(left, right);
+    _mm256_storeu_ps(dst + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(dst + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+  }
+  to_flt_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+#endif
+
+#if RTMP_HAVE_NEON
+#if RTMP_FLOAT_SAMPLES
+static void clamp_copy_neon(float *dst, const t_sample *src, size_t n) {
+  const float32x4_t lo = vdupq_n_f32(-1.0f), hi = vdupq_n_f32(1.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(dst + i, vminq_f32(vmaxq_f32(vld1q_f32(src + i), lo), hi));
+  clamp_copy_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+// Four samples clamped, scaled and rounded to int32
+static inline int32x4_t scale_neon(const float *src, float32x4_t scale) {
+  float32x4_t sample = vminq_f32(
+      vmaxq_f32(vld1q_f32(src), vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+  return vcvtnq_s32_f32(vmulq_f32(sample, scale));
+}
+
+// Eight samples scaled and saturated to int16
+static inline int16x8_t scale_s16_neon(const float *src, float32x4_t scale) {
+  return vcombine_s16(vqmovn_s32(scale_neon(src, scale)),
+                      vqmovn_s32(scale_neon(src + 4, scale)));
+}
+
+static void to_s16_neon(int16_t *dst, const float *src, size_t n) {
+  const float32x4_t scale = vdupq_n_f32(RTMP_S16_SCALE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    vst1q_s16(dst + i, scale_s16_neon(src + i, scale));
+  to_s16_scalar(dst + i, src + i, n - i);
+}
+
+static void to_s32_neon(int32_t *dst, const float *src, size_t n) {
+  const float32x4_t scale = vdupq_n_f32(RTMP_S32_SCALE);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_s32(dst + i, scale_neon(src + i, scale));
+  to_s32_scalar(dst + i, src + i, n - i);
+}
+
+// vst2 stores two registers interleaved, which is all stereo needs
+static void to_s16_stereo_neon(int16_t *dst, const float *l, const float *r,
+                               size_t n) {
+  const float32x4_t scale = vdupq_n_f32(RTMP_S16_SCALE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8x2_t pair = {{scale_s16_neon(l + i, scale),
+                         scale_s16_neon(r + i, scale)}};
+    vst2q_s16(dst + 2 * i, pair);
+  }
+  to_s16_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+
+static void to_s32_stereo_neon(int32_t *dst, const float *l, const float *r,
+                               size_t n) {
+  const float32x4_t scale = vdupq_n_f32(RTMP_S32_SCALE);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4x2_t pair = {{scale_neon(l + i, scale), scale_neon(r + i, scale)}};
+    vst2q_s32(dst + 2 * i, pair);
+  }
+  to_s32_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+
+static void to_flt_stereo_neon(float *dst, const float *l, const float *r,
+                               size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4x2_t pair = {{vld1q_f32(l + i), vld1q_f32(r + i)}};
+    vst2q_f32(dst + 2 * i, pair);
+  }
+  to_flt_stereo_scalar(dst + 2 * i, l + i, r + i, n - i);
+}
+#endif
+
+// Kernels in use, picked by select_sample_kernels()
+static t_clamp_kernel clamp_copy = clamp_copy_scalar;
+static t_s16_kernel to_s16 = to_s16_scalar;
+static t_s32_kernel to_s32 = to_s32_scalar;
+static t_s16_stereo_kernel to_s16_stereo = to_s16_stereo_scalar;
+static t_s32_stereo_kernel to_s32_stereo = to_s32_stereo_scalar;
+static t_flt_stereo_kernel to_flt_stereo = to_flt_stereo_scalar;
+
+// Pick the fastest kernels the CPU supports. Called once from setup.
+static const char *select_sample_kernels(void) {
+  const char *name = "scalar";
+#ifdef __SSE2__
+#if RTMP_FLOAT_SAMPLES
+  clamp_copy = clamp_copy_sse2;
+#endif
+  to_s16 = to_s16_sse2;
+  to_s32 = to_s32_sse2;
+  to_s16_stereo = to_s16_stereo_sse2;
+  to_s32_stereo = to_s32_stereo_sse2;
+  to_flt_stereo = to_flt_stereo_sse2;
+  name = "sse2";
+#endif
+#if RTMP_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+#if RTMP_FLOAT_SAMPLES
+    clamp_copy = clamp_copy_avx2;
+#endif
+    to_s16 = to_s16_avx2;
+    to_s32 = to_s32_avx2;
+    to_s16_stereo = to_s16_stereo_avx2;
+    to_s32_stereo = to_s32_stereo_avx2;
+    to_flt_stereo = to_flt_stereo_avx2;
+    name = "avx2";
+  }
+#endif
+#if RTMP_HAVE_NEON
+#if RTMP_FLOAT_SAMPLES
+  clamp_copy = clamp_copy_neon;
+#endif
+  to_s16 = to_s16_neon;
+  to_s32 = to_s32_neon;
+  to_s16_stereo = to_s16_stereo_neon;
+  to_s32_stereo = to_s32_stereo_neon;
+  to_flt_stereo = to_flt_stereo_neon;
+  name = "neon";
+#endif
+  return name;
+}
+
+// Frame converters: accumulated float planes to the encoder's sample format.
+// FLTP needs no conversion; the accumulator then fills the frame directly.
+typedef void (*t_frame_converter)(uint8_t **dst, float *const *src,
+                                  int channels, size_t n);
+
+static void convert_to_s16p(uint8_t **dst, float *const *src, int channels,
+                            size_t n) {
+  for (int ch = 0; ch < channels; ch++)
+    to_s16((int16_t *)dst[ch], src[ch], n);
+}
+
+static void convert_to_s32p(uint8_t **dst, float *const *src, int channels,
+                            size_t n) {
+  for (int ch = 0; ch < channels; ch++)
+    to_s32((int32_t *)dst[ch], src[ch], n);
+}
+
+// Floats need no conversion, only interleaving: mono is copied, stereo goes
+// through a kernel and wider layouts are interleaved sample by sample.
+static void convert_to_flt(uint8_t **dst, float *const *src, int channels,
+                           size_t n) {
+  float *out = (float *)dst[0];
+  if (channels == 1) {
+    memcpy(out, src[0], n * sizeof(float));
+    return;
+  }
+  if (channels == 2) {
+    to_flt_stereo(out, src[0], src[1], n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++)
+    for (int ch = 0; ch < channels; ch++)
+      *out++ = src[ch][i];
+}
+
+// Mono and stereo go straight through a kernel. Wider layouts convert each
+// plane a chunk at a time with the plain kernel and then only shuffle the
+// integers into place; the same goes for convert_to_s32.
+static void convert_to_s16(uint8_t **dst, float *const *src, int channels,
+                           size_t n) {
+  int16_t *out = (int16_t *)dst[0];
+  if (channels == 1) {
+    to_s16(out, src[0], n);
+    return;
+  }
+  if (channels == 2) {
+    to_s16_stereo(out, src[0], src[1], n);
+    return;
+  }
+  int16_t chunk[RTMP_MAX_CHANNELS][RTMP_CONVERT_CHUNK];
+  for (size_t done = 0; done < n; done += RTMP_CONVERT_CHUNK) {
+    size_t len = n - done < RTMP_CONVERT_CHUNK ? n - done : RTMP_CONVERT_CHUNK;
+    for (int ch = 0; ch < channels; ch++)
+      to_s16(chunk[ch], src[ch] + done, len);
+    for (size_t i = 0; i < len; i++)
+      for (int ch = 0; ch < channels; ch++)
+        *out++ = chunk[ch][i];
+  }
+}
+
+static void convert_to_s32(uint8_t **dst, float *const *src, int channels,
+                           size_t n) {
+  int32_t *out = (int32_t *)dst[0];
+  if (channels == 1) {
+    to_s32(out, src[0], n);
+    return;
+  }
+  if (channels == 2) {
+    to_s32_stereo(out, src[0], src[1], n);
+    return;
+  }
+  int32_t chunk[RTMP_MAX_CHANNELS][RTMP_CONVERT_CHUNK];
+  for (size_t done = 0; done < n; done += RTMP_CONVERT_CHUNK) {
+    size_t len = n - done < RTMP_CONVERT_CHUNK ? n - done : RTMP_CONVERT_CHUNK;
+    for (int ch = 0; ch < channels; ch++)
+      to_s32(chunk[ch], src[ch] + done, len);
+    for (size_t i = 0; i < len; i++)
+      for (int ch = 0; ch < channels; ch++)
+        *out++ = chunk[ch][i];
+  }
+}
+
+// Returns the converter for fmt, or NULL if frames can be filled directly.
+// Sets *supported to 0 for formats without a converter.
+static t_frame_converter select_frame_converter(enum AVSampleFormat fmt,
+                                                int *supported) {
+  *supported = 1;
+  switch (fmt) {
+  case AV_SAMPLE_FMT_FLTP:
+    return NULL;
+  case AV_SAMPLE_FMT_FLT:
+    return convert_to_flt;
+  case AV_SAMPLE_FMT_S16:
+    return convert_to_s16;
+  case AV_SAMPLE_FMT_S16P:
+    return convert_to_s16p;
+  case AV_SAMPLE_FMT_S32:
+    return convert_to_s32;
+  case AV_SAMPLE_FMT_S32P:
+    return convert_to_s32p;
+  default:
+    *supported = 0;
+    return NULL;
+  }
+}
+
+// Codecs
+//
+// Selectable with the "codec" message or a creation argument. The encoder
+// is looked up by name first (external libraries such as libopus are better
+// than FFmpeg's native encoders), then by codec id.
+
+typedef struct _codec_desc {
+  const char *name;       // Name used in Pd
+  enum AVCodecID id;      // Codec id, also used to find an encoder
+  const char *encoder;    // Preferred encoder, NULL for the default
+  int default_bit_rate;   // Bits per second, 0 for lossless codecs
+  int min_bit_rate;       // Lowest adaptive bitrate, 0 for lossless codecs
+} t_codec_desc;
+
+static const t_codec_desc codec_descs[] = {
+    {"aac", AV_CODEC_ID_AAC, NULL, 128000, 32000},
+    {"opus", AV_CODEC_ID_OPUS, "libopus", 96000, 16000},
+    {"mp3", AV_CODEC_ID_MP3, "libmp3lame", 128000, 32000},
+    {"flac", AV_CODEC_ID_FLAC, NULL, 0, 0},
+    {"pcm", AV_CODEC_ID_PCM_S16LE, NULL, 0, 0},
+};
+
+#define RTMP_NUM_CODECS ((int)(sizeof(codec_descs) / sizeof(codec_descs[0])))
+
+// Sample formats the frame converters produce, best first
+static const enum AVSampleFormat preferred_sample_fmts[] = {
+    AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT,  AV_SAMPLE_FMT_S32P,
+    AV_SAMPLE_FMT_S32,  AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16};
+
+// Transports
+//
+// The URL scheme decides the muxer and the protocol options. Anything that
+// is not a URL is written to a file, muxed according to its extension.
+
+typedef struct _transport {
+  const char *scheme;     // URL prefix
+  const char *format;     // Muxer, NULL to choose by codec (icecast)
+} t_transport;
+
+static const t_transport transports[] = {
+    {"rtmp://", "flv"},    {"rtmps://", "flv"},  {"tcp://", "flv"},
+    {"rtsp://", "rtsp"},   {"srt://", "mpegts"}, {"udp://", "mpegts"},
+    {"icecast://", NULL},
+};
+
+#define RTMP_NUM_TRANSPORTS ((int)(sizeof(transports) / sizeof(transports[0])))
+
+static const t_transport *find_transport(const char *url) {
+  for (int i = 0; i < RTMP_NUM_TRANSPORTS; i++)
+    if (!strncmp(url, transports[i].scheme, strlen(transports[i].scheme)))
+      return &transports[i];
+  return NULL;
+}
+
+// Icecast takes a bare elementary or Ogg stream with a matching MIME type
+static const char *icecast_format(enum AVCodecID id,
+                                  const char **content_type) {
+  switch (id) {
+  case AV_CODEC_ID_MP3:
+    *content_type = "audio/mpeg";
+    return "mp3";
+  case AV_CODEC_ID_AAC:
+    *content_type = "audio/aac";
+    return "adts";
+  case AV_CODEC_ID_OPUS:
+  case AV_CODEC_ID_FLAC:
+    *content_type = "audio/ogg";
+    return "ogg";
+  default:
+    return NULL;
+  }
+}
+
+// The encoder rate closest to the wanted one; encoders that take any rate
+// get it unchanged
+static int select_sample_rate(const AVCodec *codec, int wanted) {
+  if (!codec->supported_samplerates)
+    return wanted;
+  int best = 0;
+  for (const int *rate = codec->supported_samplerates; *rate; rate++)
+    if (!best || abs(*rate - wanted) < abs(best - wanted))
+      best = *rate;
+  return best ? best : wanted;
+}
+
+static const t_codec_desc *find_codec_desc(const char *name) {
+  for (int i = 0; i < RTMP_NUM_CODECS; i++)
+    if (!strcmp(codec_descs[i].name, name))
+      return &codec_descs[i];
+  return NULL;
+}
+
+static const AVCodec *find_encoder(const t_codec_desc *desc) {
+  const AVCodec *codec = NULL;
+  if (desc->encoder)
+    codec = avcodec_find_encoder_by_name(desc->encoder);
+  if (!codec)
+    codec = avcodec_find_encoder(desc->id);
+  return codec;
+}
+
+// Pick the encoder's best sample format that a frame converter can produce,
+// so the conversion is settled once per session rather than per sample.
+// Returns AV_SAMPLE_FMT_NONE if there is none.
+static enum AVSampleFormat select_sample_fmt(const AVCodec *codec) {
+  if (!codec->sample_fmts)
+    return AV_SAMPLE_FMT_FLTP;
+  for (size_t i = 0;
+       i < sizeof(preferred_sample_fmts) / sizeof(preferred_sample_fmts[0]);
+       i++) {
+    for (const enum AVSampleFormat *fmt = codec->sample_fmts;
+         *fmt != AV_SAMPLE_FMT_NONE; fmt++)
+      if (*fmt == preferred_sample_fmts[i])
+        return *fmt;
+  }
+  return AV_SAMPLE_FMT_NONE;
+}
+
+// Define the class pointer
+static t_class *rtmpstreamer_tilde_class;
+
+// Lock-free single-producer/single-consumer planar sample ring buffer.
+// The DSP thread is the only writer and the streaming worker the only reader,
+// so each index is only ever stored by one side.
+typedef struct _ring_buffer {
+  float *data;         // Sample storage, one plane per channel
+  size_t capacity;     // Samples per channel, always a power of two
+  int channels;        // Number of planes
+  atomic_size_t head;  // Total samples written (producer)
+  atomic_size_t tail;  // Total samples read (consumer)
+} t_ring_buffer;
+
+// Bounded history of audio that could not be sent yet. Owned by the worker;
+// when full, the oldest samples are overwritten.
+typedef struct _preroll_buffer {
+  float *data;      // Sample storage, one plane per channel
+  size_t capacity;  // Samples per channel, 0 disables pre-roll
+  int channels;     // Number of planes
+  size_t start;     // Index of the oldest sample
+  size_t count;     // Samples currently stored
+} t_preroll_buffer;
+
+// Latency samples of one pipeline stage. Written by worker threads with
+// relaxed atomics and taken (read and reset) by the Pd thread, so neither
+// side ever blocks.
+typedef struct _latency_stat {
+  atomic_ullong total_us; // Sum of samples since the last report
+  atomic_uint count;      // Samples since the last report
+  atomic_uint max_us;     // Largest sample since the last report
+} t_latency_stat;
+
+// Messages between the Pd thread and the worker tasks. Commands go from Pd
+// to the encoder task, which applies them between frames; replies go from
+// any worker task to the Pd clock, which prints or outputs them.
+typedef enum _message_type {
+  CMD_STOP,                  // Flush, close the outputs and finish
+  CMD_OVERFLOW,              // value: t_queue_policy for full output queues
+  CMD_PAUSE,                 // value: t_pause_mode, PAUSE_OFF to resume
+  REPLY_ERROR,               // text: error to print
+  REPLY_BITRATE,             // output switched to value bits per second
+  REPLY_STOPPED              // session number value has finished
+} t_message_type;
+
+typedef struct _message {
+  t_message_type type;
+  int output;                // Index of the output concerned, or -1
+  int value;
+  char text[256];
+} t_message;
+
+// Bounded lock-free queue of messages, safe for any number of producers and
+// consumers. Each slot's sequence number says whether it is free for the
+// write at that position or holds the message for the read at it, so
+// neither side ever takes a lock.
+typedef struct _message_slot {
+  atomic_size_t seq;
+  t_message msg;
+} t_message_slot;
+
+typedef struct _message_queue {
+  t_message_slot slots[RTMP_MESSAGE_SLOTS];
+  atomic_size_t head;        // Position of the next write
+  atomic_size_t tail;        // Position of the next read
+  atomic_uint lost;          // Messages dropped because the queue was full
+} t_message_queue;
+
+// A unit of work for one of the worker pools: the encoder of an object, or
+// the writer of one of its outputs. A pool never runs a task on two threads
+// at once, and a task woken while running runs again afterwards, so
+// everything one task does happens in order. Fields are guarded by the pool
+// mutex.
+typedef struct _pool_task t_pool_task;
+typedef struct _worker_pool t_worker_pool;
+
+// Runs one step of a task. Returns the delay in milliseconds before the
+// next step, POOL_TASK_IDLE to wait for pool_task_wake, or POOL_TASK_DONE.
+typedef int (*t_pool_task_fn)(t_pool_task *task);
+#define POOL_TASK_IDLE (-1)
+#define POOL_TASK_DONE (-2)
+
+// Runs on the pool thread once a step has finished the task and the pool no
+// longer touches it, so it may start the task again or free it. A task
+// cancelled while it was not running gets it on the cancelling thread.
+typedef void (*t_pool_task_done_fn)(t_pool_task *task);
+
+struct _pool_task {
+  t_worker_pool *pool;       // Pool the task runs on
+  t_pool_task_fn fn;
+  t_pool_task_done_fn finished; // NULL if nothing has to happen
+  void *owner;               // Streamer, rendition or output the task
+                             // works for
+  t_pool_task *next;         // Link in the ready or timer list
+  int64_t due;               // av_gettime_relative() of a timed step
+  int queued;                // 1 in the ready list, 2 in the timer list
+  int running;               // A pool thread is inside fn
+  int woken;                 // Woken while running: step again right away
+  int done;                  // Not started, or fn returned POOL_TASK_DONE
+  int cancel;                // Finish once the running step returns
+};
+
+// Preallocated packets of one session, shared by the encoder and the
+// writers. The encoder takes one per output for every encoded packet and the
+// writer gives it back once written or dropped, so streaming never allocates
+// packet structs. Sized so that every queue can be full at once.
+typedef struct _packet_pool {
+  AVPacket **free;           // Packets not in use
+  int count;                 // Entries in free
+  int capacity;              // Packets owned by the pool
+  pthread_mutex_t mutex;
+} t_packet_pool;
+
+// Streaming state of an object, shared with its worker tasks
+struct _streamer;
+
+// One encoding of the stream at its own bitrate. All renditions share the
+// converted and resampled frames. Rendition 0 is the main encoder and runs on
+// the encoder task; the others are encoded in parallel on tasks of their own
+// and joined before the next frame, so their packets stay in step.
+typedef struct _rendition {
+  struct _streamer *owner;   // Streamer the rendition belongs to
+  int index;                 // Position in the object's renditions
+  AVCodecContext *ctx;       // Encoder; rendition 0's is the codec_ctx
+  AVPacket *packet;          // Receives packets from ctx
+  AVFrame *frame;            // Frame of the current job, NULL to flush
+  atomic_int job;            // t_rendition_job
+  t_pool_task task;          // Encodes jobs of renditions other than 0
+} t_rendition;
+
+// One destination of the encoded stream. Every output has its own writer
+// task, connection state and packet queue, so a dead or slow endpoint
+// never holds up the encoder or the other outputs.
+typedef struct _rtmp_output {
+  struct _streamer *owner;   // Streamer the output belongs to
+  t_symbol *url;             // Destination URL, or the archive file pattern
+  int archive;               // Local recording into rolling segment files
+  AVFormatContext *fmt_ctx;  // Format context
+  AVStream *audio_st;        // Audio stream
+  int header_written;        // Set once avformat_write_header succeeded
+  int session_failed;        // Writer only: the current session is broken
+  int direct_write;          // Writer only: bypass interleaving, flush often
+  atomic_llong io_deadline;  // av_gettime_relative() after which the writer's
+                             // current FFmpeg call is interrupted, 0 for never
+
+  // Encoded packets waiting to be written (guarded by mutex)
+  AVPacket *queue[RTMP_OUTPUT_QUEUE_PACKETS];
+  int queue_head;            // Index of the oldest packet
+  int queue_count;           // Packets in the queue
+  int quit;                  // Tells the writer to drain the queue and exit
+  pthread_mutex_t mutex;
+  atomic_uint dropped_packets; // Packets discarded by overflow or failure
+  atomic_int queue_fill;     // Mirror of queue_count for the stats report
+  unsigned reported_dropped_packets;
+
+  t_pool_task task;          // Connects and writes on the I/O pool
+  int connected;             // Writer only: a session is open
+  int reconnecting;          // Writer only: the last session dropped
+  int backoff_ms;            // Writer only: wait before the next attempt
+  atomic_int state;          // Current t_stream_state
+  t_stream_state reported_state; // Last state sent to the outlet
+
+  // Renditions, assigned when the session starts
+  int rendition;             // Rendition of the main stream
+  int extra_stream[RTMP_MAX_RENDITIONS]; // Stream index of each rendition
+                                         // carried besides, 0 for none
+  int num_streams;           // Audio streams in the container
+
+  // Adaptive bitrate, evaluated by the encoder task
+  int rung;                  // Rendition currently feeding the main stream
+  int64_t next_pts;          // Encoder only: pts expected after the last packet
+  t_latency_stat abr_latency; // Write times since the last evaluation
+  unsigned abr_dropped;      // Encoder only: dropped_packets at that time
+  int abr_calm;              // Encoder only: calm evaluations in a row
+  int reported_bit_rate;     // Last bitrate reported, 0 for none
+} t_rtmp_output;
+
+// Everything the worker tasks of an object touch. The object and a running
+// session each hold a reference, so a session that is still flushing and
+// closing its outputs when the object is freed keeps the streamer until it
+// has finished, and then frees it. Settings are copied in from the object
+// when a session starts and stay fixed while it runs.
+typedef struct _streamer {
+  atomic_int refs;           // The object, and the session while it runs
+  int session;               // Number of the current or last session
+  t_rtmp_output *outputs;    // Destinations, all fed by one encoder
+  int num_outputs;
+  AVCodecContext *codec_ctx; // Codec context
+  t_rendition renditions[RTMP_MAX_RENDITIONS]; // Main encoder first
+  int num_renditions;        // Encoders open this session
+  pthread_mutex_t rendition_mutex;
+  pthread_cond_t rendition_done; // Signalled when a rendition job is done
+  AVFrame *frame;            // Frame being filled, one of frames
+  AVFrame *frames[RTMP_FRAME_POOL]; // Encoder input frames, used in turn
+  int frame_index;           // Index of frame in frames
+  t_packet_pool packets;     // Packets handed to the outputs
+  AVBufferPool *packet_buffers; // Payloads of encoded packets, NULL until
+                                // the frame size is known
+  int packet_buffer_size;    // Bytes per payload, padding included
+  atomic_uint pool_misses;   // Frames or packets the pools could not supply
+  int frame_capacity;        // Samples per encoder frame (codec frame_size)
+  int frame_fill;            // Samples accumulated in frame so far
+  t_frame_converter convert; // Converts staging to the codec's sample format
+  float *staging;            // Float planes accumulated before conversion
+  size_t staging_size;       // Bytes allocated for staging
+  int64_t pts;               // Presentation timestamp
+  int channels;              // Encoded channels
+  const t_codec_desc *codec; // Codec of the session
+  int bit_rate;              // Bits per second, 0 for the codec's default
+  int low_latency;           // Low-latency mode
+  int abr;                   // Adaptive bitrate
+  int ladder[RTMP_MAX_RENDITIONS]; // Rendition bitrates, main one first
+  int ladder_size;           // 0 for a single rendition
+  int64_t abr_next;          // Worker: av_gettime_relative() of the next
+                             // adaptive bitrate evaluation
+  int out_rate;              // Stream sample rate, 0 to follow Pd
+  SwrContext *resampler;     // Pd rate to stream rate, NULL if they match
+  int in_rate;               // Worker: Pd rate the resampler is set up for
+  int start_rate;            // Pd rate when the session started, taken on
+                             // the Pd thread; later changes come as
+                             // pending_rate
+  atomic_int pending_rate;   // New Pd rate for the worker, 0 if none
+  atomic_size_t pending_rate_pos; // Ring position the new rate starts at
+  float *resample_in;        // Float planes of Pd-rate input for resampler
+  int poll_ms;               // Worker sleep when idle, set per session
+  atomic_int block_size;     // Pd block size, from the DSP method
+  atomic_int pipeline_latency_us; // Capture to encoded packet, estimated
+  atomic_int frame_us;       // Duration of one encoded frame
+  atomic_int streaming_active; // Flag to indicate if streaming is active
+
+  // Confidence monitor: the encoded stream decoded for the signal outlet
+  atomic_int monitor;        // t_monitor_mode
+  t_ring_buffer monitor_ring; // Decoded mono audio at Pd's rate
+  atomic_int monitor_prebuffer; // Samples buffered before playback starts
+  AVCodecContext *monitor_dec; // Worker only: decoder, opened on demand
+  SwrContext *monitor_swr;   // Decoded format to mono float at Pd's rate
+  AVFrame *monitor_frame;    // Decoded frame
+  float *monitor_buf;        // Resampled chunk before it enters the ring
+  int monitor_failed;        // Decoder could not be opened this session
+
+  // DSP to worker hand-off
+  t_ring_buffer ring;        // Samples waiting to be encoded
+  t_preroll_buffer preroll;  // Audio held while no output is connected
+  atomic_int reconnect;      // Retry failed connections with backoff
+  t_float archive_segment;   // Seconds per archive file
+
+  // Streaming worker (encoder)
+  t_pool_task task;          // Encodes and feeds the outputs on the encode pool
+  int worker_phase;          // Worker only: t_worker_phase
+  atomic_int writers_running; // Output tasks that have not finished
+  t_message_queue commands;  // Pd thread to encoder task
+  t_message_queue replies;   // Worker tasks to the Pd clock
+  atomic_int stop_requested; // Stop that did not fit in the command queue
+  int worker_quit;           // Worker only: CMD_STOP received
+  t_queue_policy policy;     // Worker only: overflow policy in effect
+  t_pause_mode pause;        // Worker only: pause mode in effect
+  atomic_int worker_exited;  // Set once the session's tasks have finished
+  atomic_llong abort_deadline; // av_gettime_relative() after which blocking
+                               // FFmpeg I/O is interrupted, 0 for never
+
+  // Error counters written by the worker, reported by the Pd clock
+  atomic_uint dropped_samples;
+  atomic_uint encode_errors;
+  atomic_uint write_errors;
+  atomic_uint reconnects;    // Sessions re-established after a failure
+
+  // Statistics, reported on the right outlet on "stats"
+  atomic_ullong bytes_written;   // Encoded bytes written, all outputs
+  atomic_ullong packets_written; // Packets written, all outputs
+  t_latency_stat encode_latency; // Time spent in the encoder per frame
+  t_latency_stat write_latency;  // Time spent in each muxer write
+} t_streamer;
+
+typedef struct _rtmpstreamer_tilde {
+  t_object x_obj;            // The object itself
+  t_sample f;                // Signal inlet placeholder
+  int channels;              // Number of signal inlets and encoded channels
+  t_streamer *st;            // Streaming state, shared with the worker tasks
+
+  // Settings for the next session
+  t_symbol *urls[RTMP_MAX_OUTPUTS]; // Destinations set last
+  int num_urls;
+  const t_codec_desc *codec; // Codec
+  int bit_rate;              // Bits per second, 0 for the codec's default
+  int low_latency;           // Low-latency mode
+  int abr;                   // Adaptive bitrate
+  int ladder[RTMP_MAX_RENDITIONS]; // Rendition bitrates, main one first
+  int ladder_size;           // 0 for a single rendition
+  int out_rate;              // Stream sample rate, 0 to follow Pd
+  t_float preroll_seconds;   // Pre-roll length
+  t_symbol *archive_path;    // Archive file pattern, NULL when not recording
+  t_float archive_segment;   // Seconds per archive file
+  t_queue_policy queue_policy; // Policy for full output queues, also sent
+                               // to a running session by command
+  t_pause_mode paused;       // Pause requested, kept over restarts
+  int outputs_changed;       // URLs or archive changed since the streamer's
+                             // outputs were built
+
+  // Session lifecycle, Pd thread only. Nothing here waits for the worker
+  // tasks: a stop is a command, and the session reports back through the
+  // reply queue once it has finished.
+  int worker_running;        // Set from the start until the session is done
+  int stopping;              // Stop sent, waiting for the session to finish
+  int restart;               // Start a session once the stopping one is done
+
+  int dsp_rate;              // Pd thread: sample rate of the last DSP setup
+  int monitor_primed;        // DSP only: playing rather than buffering
+
+  // Reporting on the Pd thread
+  int reported_latency_us;
+  unsigned reported_dropped;
+  unsigned reported_encode_errors;
+  unsigned reported_write_errors;
+  unsigned long long stats_bytes; // bytes_written at the last report
+  double stats_time;         // Logical time of the last report
+  t_float stats_interval;    // Milliseconds between reports, 0 for off
+  t_clock *stats_clock;      // Sends periodic reports
+  unsigned reported_lost_replies;
+  t_clock *clock;            // Reports worker state on the Pd thread
+  t_outlet *state_out;       // Control outlet for state changes
+} t_rtmpstreamer_tilde;
+
+// Function prototypes
+void rtmpstreamer_tilde_symbol(t_rtmpstreamer_tilde *x, t_symbol *s);
+void rtmpstreamer_tilde_url(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                            t_atom *argv);
+void rtmpstreamer_tilde_dsp(t_rtmpstreamer_tilde *x, t_signal **sp);
+t_int *rtmpstreamer_tilde_perform(t_int *w);
+void *rtmpstreamer_tilde_new(t_symbol *sel, int argc, t_atom *argv);
+void rtmpstreamer_tilde_free(t_rtmpstreamer_tilde *x);
+void rtmpstreamer_tilde_tick(t_rtmpstreamer_tilde *x);
+void rtmpstreamer_tilde_start(t_rtmpstreamer_tilde *x);
+void rtmpstreamer_tilde_stop(t_rtmpstreamer_tilde *x);
+void rtmpstreamer_tilde_pause(t_rtmpstreamer_tilde *x, t_symbol *s);
+void rtmpstreamer_tilde_resume(t_rtmpstreamer_tilde *x);
+void rtmpstreamer_tilde_reconnect(t_rtmpstreamer_tilde *x, t_floatarg f);
+void rtmpstreamer_tilde_preroll(t_rtmpstreamer_tilde *x, t_floatarg f);
+void rtmpstreamer_tilde_overflow(t_rtmpstreamer_tilde *x, t_symbol *s);
+void rtmpstreamer_tilde_codec(t_rtmpstreamer_tilde *x, t_symbol *s,
+                              t_floatarg kbps);
+void rtmpstreamer_tilde_latency(t_rtmpstreamer_tilde *x, t_symbol *s);
+void rtmpstreamer_tilde_samplerate(t_rtmpstreamer_tilde *x, t_floatarg f);
+void rtmpstreamer_tilde_abr(t_rtmpstreamer_tilde *x, t_floatarg f);
+void rtmpstreamer_tilde_ladder(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                               t_atom *argv);
+void rtmpstreamer_tilde_monitor(t_rtmpstreamer_tilde *x, t_symbol *s);
+void rtmpstreamer_tilde_archive(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                                t_atom *argv);
+void rtmpstreamer_tilde_stats(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                              t_atom *argv);
+void rtmpstreamer_tilde_stats_tick(t_rtmpstreamer_tilde *x);
+void rtmpstreamer_tilde_setup(void);
+
+// Helper function prototypes
+int initialize_streaming(t_streamer *x);
+void cleanup_streaming(t_streamer *x);
+int open_output(t_streamer *x, t_rtmp_output *out);
+void close_output(t_rtmp_output *out);
+int start_streaming_worker(t_rtmpstreamer_tilde *x);
+void stop_streaming_worker(t_rtmpstreamer_tilde *x);
+
+static void streaming_error(t_streamer *x, const char *fmt, ...);
+static void streamer_release(t_streamer *x);
+
+// Ring buffer helpers
+static int ring_buffer_init(t_ring_buffer *rb, int channels,
+                            size_t min_capacity);
+static void ring_buffer_free(t_ring_buffer *rb);
+static void ring_buffer_reset(t_ring_buffer *rb);
+static size_t ring_buffer_available(t_ring_buffer *rb);
+static size_t ring_buffer_write_clamped(t_ring_buffer *rb, t_sample **in,
+                                        size_t n);
+static size_t ring_buffer_read(t_ring_buffer *rb, float *const *out,
+                               size_t offset, size_t n);
+static size_t ring_buffer_write(t_ring_buffer *rb, float *const *in, size_t n);
+static size_t ring_buffer_read_signal(t_ring_buffer *rb, t_sample *out,
+                                      size_t n);
+
+// Pre-roll buffer helpers
+static int preroll_buffer_init(t_preroll_buffer *pb, int channels,
+                               size_t capacity);
+static void preroll_buffer_free(t_preroll_buffer *pb);
+static void preroll_buffer_fill(t_preroll_buffer *pb, t_ring_buffer *rb);
+static size_t preroll_buffer_read(t_preroll_buffer *pb, float *const *out,
+                                  size_t offset, size_t n);
+
+// Ring buffer implementation
+
+static int ring_buffer_init(t_ring_buffer *rb, int channels,
+                            size_t min_capacity) {
+  size_t capacity = 1;
+  while (capacity < min_capacity)
+    capacity <<= 1;
+
+  rb->data = (float *)getbytes(capacity * channels * sizeof(float));
+  if (!rb->data)
+    return -1;
+  rb->capacity = capacity;
+  rb->channels = channels;
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->tail, 0);
+  return 0;
+}
+
+static void ring_buffer_free(t_ring_buffer *rb) {
+  if (rb->data) {
+    freebytes(rb->data, rb->capacity * rb->channels * sizeof(float));
+    rb->data = NULL;
+  }
+  rb->capacity = 0;
+}
+
+// Discard pending samples. Called by the consumer or while it is stopped.
+static void ring_buffer_reset(t_ring_buffer *rb) {
+  atomic_store_explicit(&rb->tail,
+                        atomic_load_explicit(&rb->head, memory_order_acquire),
+                        memory_order_release);
+}
+
+// Number of samples per channel ready for the consumer
+static size_t ring_buffer_available(t_ring_buffer *rb) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  return head - tail;
+}
+
+// Copy up to n samples of every channel into the ring, clamping them to
+// [-1.0, 1.0]. Called from the DSP thread; never blocks. Returns samples
+// written per channel.
+static size_t ring_buffer_write_clamped(t_ring_buffer *rb, t_sample **in,
+                                        size_t n) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  size_t space = rb->capacity - (head - tail);
+  if (n > space)
+    n = space;
+
+  size_t pos = head & (rb->capacity - 1);
+  size_t first = rb->capacity - pos;
+  if (first > n)
+    first = n;
+  for (int ch = 0; ch < rb->channels; ch++) {
+    float *plane = rb->data + ch * rb->capacity;
+    clamp_copy(plane + pos, in[ch], first);
+    clamp_copy(plane, in[ch] + first, n - first);
+  }
+
+  atomic_store_explicit(&rb->head, head + n, memory_order_release);
+  return n;
+}
+
+// Copy up to n samples of every channel into the ring without clamping.
+// Called from the worker thread when it is the producer. Returns samples
+// written per channel.
+static size_t ring_buffer_write(t_ring_buffer *rb, float *const *in, size_t n) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  size_t space = rb->capacity - (head - tail);
+  if (n > space)
+    n = space;
+
+  size_t pos = head & (rb->capacity - 1);
+  size_t first = rb->capacity - pos;
+  if (first > n)
+    first = n;
+  for (int ch = 0; ch < rb->channels; ch++) {
+    float *plane = rb->data + ch * rb->capacity;
+    memcpy(plane + pos, in[ch], first * sizeof(float));
+    memcpy(plane, in[ch] + first, (n - first) * sizeof(float));
+  }
+
+  atomic_store_explicit(&rb->head, head + n, memory_order_release);
+  return n;
+}
+
+// Copy up to n samples of the first channel out of the ring into a signal
+// vector. Called from the DSP thread when it is the consumer.
+static size_t ring_buffer_read_signal(t_ring_buffer *rb, t_sample *out,
+                                      size_t n) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  if (n > head - tail)
+    n = head - tail;
+
+  size_t pos = tail & (rb->capacity - 1);
+  for (size_t i = 0; i < n; i++)
+    out[i] = rb->data[(pos + i) & (rb->capacity - 1)];
+
+  atomic_store_explicit(&rb->tail, tail + n, memory_order_release);
+  return n;
+}
+
+// Copy up to n samples of every channel out of the ring, starting at sample
+// offset in each plane of out. Called from the worker thread.
+static size_t ring_buffer_read(t_ring_buffer *rb, float *const *out,
+                               size_t offset, size_t n) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  if (n > head - tail)
+    n = head - tail;
+
+  size_t pos = tail & (rb->capacity - 1);
+  size_t first = rb->capacity - pos;
+  if (first > n)
+    first = n;
+  for (int ch = 0; ch < rb->channels; ch++) {
+    const float *plane = rb->data + ch * rb->capacity;
+    memcpy(out[ch] + offset, plane + pos, first * sizeof(float));
+    memcpy(out[ch] + offset + first, plane, (n - first) * sizeof(float));
+  }
+
+  atomic_store_explicit(&rb->tail, tail + n, memory_order_release);
+  return n;
+}
+
+// Pre-roll buffer implementation
+
+static int preroll_buffer_init(t_preroll_buffer *pb, int channels,
+                               size_t capacity) {
+  pb->data = NULL;
+  pb->capacity = 0;
+  pb->channels = channels;
+  pb->start = 0;
+  pb->count = 0;
+  if (capacity == 0)
+    return 0;
+
+  pb->data = (float *)getbytes(capacity * channels * sizeof(float));
+  if (!pb->data)
+    return -1;
+  pb->capacity = capacity;
+  return 0;
+}
+
+static void preroll_buffer_free(t_preroll_buffer *pb) {
+  if (pb->data) {
+    freebytes(pb->data, pb->capacity * pb->channels * sizeof(float));
+    pb->data = NULL;
+  }
+  pb->capacity = 0;
+  pb->start = 0;
+  pb->count = 0;
+}
+
+// Move everything queued in the ring into the pre-roll, overwriting the
+// oldest audio once it is full. With pre-roll disabled the ring is drained.
+static void preroll_buffer_fill(t_preroll_buffer *pb, t_ring_buffer *rb) {
+  if (pb->capacity == 0) {
+    ring_buffer_reset(rb);
+    return;
+  }
+
+  size_t available;
+  while ((available = ring_buffer_available(rb)) > 0) {
+    size_t end = (pb->start + pb->count) % pb->capacity;
+    size_t n = pb->capacity - end;
+    if (n > available)
+      n = available;
+
+    float *planes[RTMP_MAX_CHANNELS];
+    for (int ch = 0; ch < pb->channels; ch++)
+      planes[ch] = pb->data + ch * pb->capacity;
+    ring_buffer_read(rb, planes, end, n);
+
+    pb->count += n;
+    if (pb->count > pb->capacity) {
+      pb->start = (pb->start + pb->count - pb->capacity) % pb->capacity;
+      pb->count = pb->capacity;
+    }
+  }
+}
+
+// Copy up to n of the oldest samples of every channel out of the pre-roll,
+// starting at sample offset in each plane of out
+static size_t preroll_buffer_read(t_preroll_buffer *pb, float *const *out,
+                                  size_t offset, size_t n) {
+  size_t done = 0;
+  while (done < n && pb->count > 0) {
+    size_t chunk = pb->capacity - pb->start;
+    if (chunk > pb->count)
+      chunk = pb->count;
+    if (chunk > n - done)
+      chunk = n - done;
+    for (int ch = 0; ch < pb->channels; ch++)
+      memcpy(out[ch] + offset + done, pb->data + ch * pb->capacity + pb->start,
+             chunk * sizeof(float));
+
+    pb->start = (pb->start + chunk) % pb->capacity;
+    pb->count -= chunk;
+    done += chunk;
+  }
+  return done;
+}
+
+// DSP method
+void rtmpstreamer_tilde_dsp(t_rtmpstreamer_tilde *x, t_signal **sp) {
+  // Arguments: object, block size, one input vector per channel, then the
+  // output vector
+  t_streamer *st = x->st;
+  t_int args[3 + RTMP_MAX_CHANNELS];
+  args[0] = (t_int)x;
+  args[1] = (t_int)sp[0]->s_n;
+  atomic_store(&st->block_size, sp[0]->s_n);
+  for (int ch = 0; ch < x->channels; ch++)
+    args[2 + ch] = (t_int)sp[ch]->s_vec;
+  args[2 + x->channels] = (t_int)sp[x->channels]->s_vec;
+
+  // A new sample rate takes effect from the next sample written to the ring.
+  // Perform routines are not running while DSP is being set up, so the ring
+  // position is stable here. The worker switches its resampler when it gets
+  // there; the encoder and the connections stay as they are.
+  int rate = (int)sp[0]->s_sr;
+  if (rate != x->dsp_rate) {
+    if (x->worker_running && x->dsp_rate != 0) {
+      atomic_store(&st->pending_rate_pos,
+                   atomic_load_explicit(&st->ring.head, memory_order_relaxed));
+      atomic_store_explicit(&st->pending_rate, rate, memory_order_release);
+    }
+    x->dsp_rate = rate;
+  }
+
+  // Add perform method to DSP chain
+  dsp_addv(rtmpstreamer_tilde_perform, 3 + x->channels, args);
+}
+
+// Play the decoded stream on the outlet. Playback starts once enough is
+// buffered to ride out the worker's bursts of decoded frames, and goes back
+// to buffering after an underrun.
+static void monitor_play(t_rtmpstreamer_tilde *x, t_sample *out, int n) {
+  t_ring_buffer *rb = &x->st->monitor_ring;
+  if (!x->monitor_primed) {
+    size_t wanted = (size_t)atomic_load_explicit(&x->st->monitor_prebuffer,
+                                                 memory_order_relaxed) + n;
+    if (ring_buffer_available(rb) < wanted) {
+      memset(out, 0, n * sizeof(t_sample));
+      return;
+    }
+    x->monitor_primed = 1;
+  }
+  size_t got = ring_buffer_read_signal(rb, out, n);
+  if (got < (size_t)n) {
+    memset(out + got, 0, (n - got) * sizeof(t_sample));
+    x->monitor_primed = 0;
+  }
+}
+
+// Perform function
+//
+// Runs in Pd's audio callback, so it only hands the samples to the streaming
+// worker and fills the outlet. It never blocks, allocates or touches FFmpeg.
+t_int *rtmpstreamer_tilde_perform(t_int *w) {
+  t_rtmpstreamer_tilde *x = (t_rtmpstreamer_tilde *)(w[1]);
+  t_streamer *st = x->st;
+  int n = (int)(w[2]);
+  t_sample **in = (t_sample **)(w + 3); // One vector per channel
+  t_sample *out = (t_sample *)(w[3 + x->channels]);
+  int streaming = atomic_load_explicit(&st->streaming_active,
+                                       memory_order_acquire);
+
+  // If streaming is active, queue the block for the worker
+  if (streaming) {
+    size_t written = ring_buffer_write_clamped(&st->ring, in, n);
+    if (written < (size_t)n) {
+      // The worker fell behind; drop what does not fit
+      atomic_fetch_add_explicit(&st->dropped_samples, (unsigned)(n - written),
+                                memory_order_relaxed);
+    }
+  }
+
+  // The outlet may share its vector with an inlet, so it is only written
+  // once the input has been queued
+  int mode = atomic_load_explicit(&st->monitor, memory_order_relaxed);
+  if (mode == MONITOR_STREAM && streaming) {
+    monitor_play(x, out, n);
+  } else {
+    // Decoded audio left from an earlier session or mode is stale
+    ring_buffer_reset(&st->monitor_ring);
+    x->monitor_primed = 0;
+    if (mode == MONITOR_STREAM || mode == MONITOR_OFF) {
+      memset(out, 0, n * sizeof(t_sample));
+    } else if (x->channels == 1) {
+      if (out != in[0])
+        memcpy(out, in[0], n * sizeof(t_sample));
+    } else {
+      t_sample gain = (t_sample)1 / x->channels;
+      for (int i = 0; i < n; i++) {
+        t_sample sum = 0;
+        for (int ch = 0; ch < x->channels; ch++)
+          sum += in[ch][i];
+        out[i] = sum * gain;
+      }
+    }
+  }
+
+  return (w + 4 + x->channels);
+}
+
+// Latency statistics
+
+static void latency_stat_init(t_latency_stat *ls) {
+  atomic_init(&ls->total_us, 0);
+  atomic_init(&ls->count, 0);
+  atomic_init(&ls->max_us, 0);
+}
+
+// Record one sample, measured from start (av_gettime_relative)
+static void latency_stat_add(t_latency_stat *ls, int64_t start) {
+  int64_t elapsed = av_gettime_relative() - start;
+  unsigned us = elapsed > 0 ? (unsigned)elapsed : 0;
+  atomic_fetch_add_explicit(&ls->total_us, us, memory_order_relaxed);
+  atomic_fetch_add_explicit(&ls->count, 1, memory_order_relaxed);
+  unsigned max = atomic_load_explicit(&ls->max_us, memory_order_relaxed);
+  while (us > max && !atomic_compare_exchange_weak_explicit(
+                         &ls->max_us, &max, us, memory_order_relaxed,
+                         memory_order_relaxed))
+    ;
+}
+
+// Take the mean and maximum in milliseconds and start a new interval
+static void latency_stat_take(t_latency_stat *ls, t_float *mean_ms,
+                              t_float *max_ms) {
+  unsigned long long total = atomic_exchange(&ls->total_us, 0);
+  unsigned count = atomic_exchange(&ls->count, 0);
+  unsigned max = atomic_exchange(&ls->max_us, 0);
+  *mean_ms = count ? (t_float)(total / (double)count / 1000.0) : 0;
+  *max_ms = (t_float)(max / 1000.0);
+}
+
+// Add ms milliseconds to the current CLOCK_REALTIME time
+static struct timespec deadline_after_ms(int ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (ms % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec += 1;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return ts;
+}
+
+// Message queues
+
+static void message_queue_init(t_message_queue *q) {
+  for (size_t i = 0; i < RTMP_MESSAGE_SLOTS; i++)
+    atomic_init(&q->slots[i].seq, i);
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->lost, 0);
+}
+
+// Append a copy of msg. Returns -1 (and counts the loss) if the queue is
+// full.
+static int message_queue_push(t_message_queue *q, const t_message *msg) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  t_message_slot *slot;
+  for (;;) {
+    slot = &q->slots[pos % RTMP_MESSAGE_SLOTS];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (seq < pos) {
+      atomic_fetch_add_explicit(&q->lost, 1, memory_order_relaxed);
+      return -1; // Full: the slot still holds an unread message
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+  slot->msg = *msg;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+// Take the oldest message into msg. Returns -1 if the queue is empty.
+static int message_queue_pop(t_message_queue *q, t_message *msg) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  t_message_slot *slot;
+  for (;;) {
+    slot = &q->slots[pos % RTMP_MESSAGE_SLOTS];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (seq < pos + 1) {
+      return -1; // Empty: nothing written at this position yet
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+  *msg = slot->msg;
+  atomic_store_explicit(&slot->seq, pos + RTMP_MESSAGE_SLOTS,
+                        memory_order_release);
+  return 0;
+}
+
+// Worker pools
+//
+// All objects in the process run their tasks on two shared sets of threads,
+// so dozens of streams cost a handful of threads rather than one per encoder
+// and URL. Encoders run on the encode pool, sized to the number of cores.
+// Writers block in DNS lookups, handshakes and socket writes, so they run on
+// the I/O pool instead. A writer waiting for packets holds no thread; the
+// pool only adds one when every thread is inside a step and another writer
+// is ready, so a stalled endpoint holds up its own writer only, never an
+// encoder or another output, and hundreds of mostly idle writers share a
+// few threads. Threads beyond the core count exit again after a while
+// without work. The threads are created when needed and joined when the
+// last object is freed. Tasks that would have slept reschedule themselves
+// with a delay instead, freeing the thread.
+
+struct _worker_pool {
+  int grow;                  // Add a thread when every thread is busy
+  int keep_threads;          // Growing pool: threads kept when idle
+  pthread_mutex_t mutex;
+  pthread_cond_t work;       // Signalled when a task is ready or a timer added
+  pthread_cond_t done;       // Broadcast when a task has finished
+  pthread_t *threads;
+  int thread_slots;          // Entries allocated in threads
+  int num_threads;           // 0 until the first task needs one
+  int active;                // Tasks started and not finished
+  int busy;                  // Threads inside a task step
+  int ready;                 // Tasks on the ready list
+  int quit;                  // Tells the threads to exit
+  t_pool_task *ready_head;   // Tasks to run, oldest first
+  t_pool_task *ready_tail;
+  t_pool_task *timers;       // Tasks waiting for their due time, soonest first
+};
+
+static t_worker_pool encode_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static t_worker_pool io_pool = {
+    .grow = 1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Objects alive in the process, plus sessions that have not finished,
+// which may outlive their object; guarded by the encode pool's mutex
+static int worker_pool_users;
+
+// Set on the pool threads, which cannot join themselves
+static _Thread_local int on_pool_thread;
+
+static void *worker_pool_main(void *arg);
+
+static void pool_task_init(t_pool_task *task, t_worker_pool *pool,
+                           t_pool_task_fn fn, t_pool_task_done_fn finished,
+                           void *owner) {
+  task->pool = pool;
+  task->fn = fn;
+  task->finished = finished;
+  task->owner = owner;
+  task->next = NULL;
+  task->due = 0;
+  task->queued = 0;
+  task->running = 0;
+  task->woken = 0;
+  task->done = 1;
+  task->cancel = 0;
+}
+
+// Start one more thread. Pool mutex held. Returns -1 on failure.
+static int pool_add_thread(t_worker_pool *pool) {
+  if (pool->num_threads == pool->thread_slots) {
+    int slots = pool->thread_slots ? pool->thread_slots * 2 : 8;
+    pthread_t *threads = (pthread_t *)getbytes(slots * sizeof(pthread_t));
+    if (!threads)
+      return -1;
+    if (pool->threads) {
+      memcpy(threads, pool->threads, pool->num_threads * sizeof(pthread_t));
+      freebytes(pool->threads, pool->thread_slots * sizeof(pthread_t));
+    }
+    pool->threads = threads;
+    pool->thread_slots = slots;
+  }
+  if (pthread_create(&pool->threads[pool->num_threads], NULL, worker_pool_main,
+                     pool) != 0)
+    return -1;
+  pool->num_threads++;
+  return 0;
+}
+
+// Append to the ready list. A growing pool gets another thread if every
+// thread is busy with a step or has a ready task to take; if that fails the
+// task waits for a thread. Pool mutex held.
+static void pool_ready_push(t_pool_task *task) {
+  t_worker_pool *pool = task->pool;
+  task->next = NULL;
+  task->queued = 1;
+  if (pool->ready_tail)
+    pool->ready_tail->next = task;
+  else
+    pool->ready_head = task;
+  pool->ready_tail = task;
+  pool->ready++;
+  if (pool->grow && pool->busy + pool->ready > pool->num_threads &&
+      pool->num_threads < RTMP_IO_POOL_MAX_THREADS)
+    pool_add_thread(pool);
+  pthread_cond_signal(&pool->work);
+}
+
+// Take a thread that has been idle too long out of a growing pool, if it
+// has more than it keeps. The thread exits on its own, so it is detached
+// rather than joined; once the pool is quitting, it is left to the join.
+// Pool mutex held. Returns 1 if the thread must exit.
+static int pool_retire_thread(t_worker_pool *pool) {
+  if (pool->quit || pool->ready_head ||
+      pool->num_threads <= pool->keep_threads)
+    return 0;
+  pthread_t self = pthread_self();
+  for (int i = 0; i < pool->num_threads; i++) {
+    if (pthread_equal(pool->threads[i], self)) {
+      pool->threads[i] = pool->threads[--pool->num_threads];
+      pthread_detach(self);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Run the task after ms milliseconds. Pool mutex held.
+static void pool_schedule(t_pool_task *task, int ms) {
+  if (ms <= 0) {
+    pool_ready_push(task);
+    return;
+  }
+  t_worker_pool *pool = task->pool;
+  task->due = av_gettime_relative() + ms * 1000LL;
+  task->queued = 2;
+  t_pool_task **link = &pool->timers;
+  while (*link && (*link)->due <= task->due)
+    link = &(*link)->next;
+  task->next = *link;
+  *link = task;
+  // A waiting thread may have to wake up earlier now
+  pthread_cond_signal(&pool->work);
+}
+
+// Mark a task finished. Pool mutex held.
+static void pool_task_finished(t_pool_task *task) {
+  task->done = 1;
+  task->cancel = 0;
+  task->pool->active--;
+  pthread_cond_broadcast(&task->pool->done);
+}
+
+// Start a finished or new task; its first step runs as soon as possible
+static void pool_task_start(t_pool_task *task) {
+  t_worker_pool *pool = task->pool;
+  pthread_mutex_lock(&pool->mutex);
+  task->done = 0;
+  task->woken = 0;
+  pool->active++;
+  pool_ready_push(task);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Run the task's next step now: an idle or delayed task is made ready, a
+// running one steps again when it returns. Finished tasks are left alone.
+static void pool_task_wake(t_pool_task *task) {
+  t_worker_pool *pool = task->pool;
+  pthread_mutex_lock(&pool->mutex);
+  if (task->done) {
+    // Nothing to do
+  } else if (task->running) {
+    task->woken = 1;
+  } else if (task->queued == 2) {
+    t_pool_task **link = &pool->timers;
+    while (*link != task)
+      link = &(*link)->next;
+    *link = task->next;
+    pool_ready_push(task);
+  } else if (!task->queued) {
+    pool_ready_push(task);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Wait until the task has finished and no pool thread touches it any more
+static void pool_task_join(t_pool_task *task) {
+  t_worker_pool *pool = task->pool;
+  pthread_mutex_lock(&pool->mutex);
+  while (!task->done)
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Finish a task without running it again: a queued or delayed task is taken
+// off its list, a running one is waited for. Unlike pool_task_join this
+// never waits for a task to be scheduled, so one task may cancel another.
+// Either way the task's finished callback runs, here or on its pool thread.
+static void pool_task_cancel(t_pool_task *task) {
+  t_worker_pool *pool = task->pool;
+  t_pool_task_done_fn finished = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (task->running) {
+    task->cancel = 1;
+    while (!task->done)
+      pthread_cond_wait(&pool->done, &pool->mutex);
+  } else if (!task->done) {
+    t_pool_task **link = task->queued == 2 ? &pool->timers : &pool->ready_head;
+    t_pool_task *prev = NULL;
+    while (task->queued && *link != task) {
+      prev = *link;
+      link = &(*link)->next;
+    }
+    if (task->queued) {
+      *link = task->next;
+      if (task->queued == 1 && pool->ready_tail == task)
+        pool->ready_tail = prev;
+      if (task->queued == 1)
+        pool->ready--;
+    }
+    task->queued = 0;
+    finished = task->finished;
+    pool_task_finished(task);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if (finished)
+    finished(task);
+}
+
+// Pool thread: runs ready tasks one step at a time, moving timed tasks to
+// the ready list when they are due
+static void *worker_pool_main(void *arg) {
+  t_worker_pool *pool = (t_worker_pool *)arg;
+  on_pool_thread = 1;
+  pthread_mutex_lock(&pool->mutex);
+  while (!pool->quit) {
+    int64_t now = av_gettime_relative();
+    while (pool->timers && pool->timers->due <= now) {
+      t_pool_task *task = pool->timers;
+      pool->timers = task->next;
+      pool_ready_push(task);
+    }
+
+    t_pool_task *task = pool->ready_head;
+    if (!task) {
+      // Threads a growing pool may give back wait at most the idle time
+      int ms = pool->timers
+                   ? (int)((pool->timers->due - now + 999) / 1000)
+                   : -1;
+      int retire = pool->grow && pool->num_threads > pool->keep_threads &&
+                   (ms < 0 || ms > RTMP_IO_POOL_IDLE_MS);
+      if (retire)
+        ms = RTMP_IO_POOL_IDLE_MS;
+      if (ms >= 0) {
+        struct timespec ts = deadline_after_ms(ms);
+        if (pthread_cond_timedwait(&pool->work, &pool->mutex, &ts) ==
+                ETIMEDOUT &&
+            retire && pool_retire_thread(pool))
+          break;
+      } else {
+        pthread_cond_wait(&pool->work, &pool->mutex);
+      }
+      continue;
+    }
+    pool->ready_head = task->next;
+    if (!pool->ready_head)
+      pool->ready_tail = NULL;
+    pool->ready--;
+    pool->busy++;
+    task->queued = 0;
+    task->running = 1;
+    task->woken = 0;
+    pthread_mutex_unlock(&pool->mutex);
+
+    int next = task->fn(task);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->busy--;
+    task->running = 0;
+    if (next == POOL_TASK_DONE || task->cancel) {
+      t_pool_task_done_fn finished = task->finished;
+      pool_task_finished(task);
+      if (finished) {
+        pthread_mutex_unlock(&pool->mutex);
+        finished(task);
+        pthread_mutex_lock(&pool->mutex);
+      }
+    } else if (task->woken) {
+      pool_ready_push(task);
+    } else if (next != POOL_TASK_IDLE) {
+      pool_schedule(task, next);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+// Register an object or a session with the pools. Pd thread only.
+static void worker_pool_retain(void) {
+  pthread_mutex_lock(&encode_pool.mutex);
+  worker_pool_users++;
+  pthread_mutex_unlock(&encode_pool.mutex);
+}
+
+// Create the encode pool threads if they do not exist yet, one per core.
+// The I/O pool starts its threads as writers need them, and keeps up to as
+// many. Returns -1 if not even one thread could be started.
+static int worker_pool_start(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int wanted = cores < RTMP_POOL_MIN_THREADS   ? RTMP_POOL_MIN_THREADS
+               : cores > RTMP_POOL_MAX_THREADS ? RTMP_POOL_MAX_THREADS
+                                               : (int)cores;
+  pthread_mutex_lock(&encode_pool.mutex);
+  int started = 0;
+  if (encode_pool.num_threads == 0)
+    while (started < wanted && pool_add_thread(&encode_pool) == 0)
+      started++;
+  int ok = encode_pool.num_threads > 0;
+  pthread_mutex_unlock(&encode_pool.mutex);
+  pthread_mutex_lock(&io_pool.mutex);
+  io_pool.keep_threads = wanted;
+  pthread_mutex_unlock(&io_pool.mutex);
+  if (started > 0)
+    logpost(NULL, 4, "[rtmpstreamer~] Started %d encoder threads", started);
+  return ok ? 0 : -1;
+}
+
+// Stop and join every thread of one pool; its tasks must have finished
+static void worker_pool_stop(t_worker_pool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 0; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+  if (pool->threads)
+    freebytes(pool->threads, pool->thread_slots * sizeof(pthread_t));
+  pool->threads = NULL;
+  pool->thread_slots = 0;
+  pool->num_threads = 0;
+  pool->quit = 0;
+}
+
+// Unregister an object or a session; the last one stops the pool threads.
+// A session ends on a pool thread, which cannot join itself: if it is the
+// last, the idle threads are left for the next object to use or stop.
+static void worker_pool_release(void) {
+  pthread_mutex_lock(&encode_pool.mutex);
+  int last = --worker_pool_users == 0;
+  pthread_mutex_unlock(&encode_pool.mutex);
+  if (!last || on_pool_thread)
+    return;
+  worker_pool_stop(&encode_pool);
+  worker_pool_stop(&io_pool);
+}
+
+// FFmpeg network state
+//
+// avformat_network_init/deinit set up process-wide state (TLS libraries,
+// sockets on Windows), so they are counted rather than called per session:
+// deinitializing while another object streams would break it. The class
+// takes the first reference in setup and every object holds one while it
+// exists, so sessions and reconnects never pay for the setup again.
+
+static pthread_mutex_t network_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int network_users;
+
+static void network_retain(void) {
+  pthread_mutex_lock(&network_mutex);
+  if (network_users++ == 0)
+    avformat_network_init();
+  pthread_mutex_unlock(&network_mutex);
+}
+
+static void network_release(void) {
+  pthread_mutex_lock(&network_mutex);
+  if (--network_users == 0)
+    avformat_network_deinit();
+  pthread_mutex_unlock(&network_mutex);
+}
+
+// Packet pool
+
+// Allocate every packet up front. Worker thread only, before the writers run.
+static int packet_pool_init(t_packet_pool *pool, int capacity) {
+  pool->free = (AVPacket **)getbytes(capacity * sizeof(AVPacket *));
+  if (!pool->free)
+    return -1;
+  pool->capacity = capacity;
+  for (pool->count = 0; pool->count < capacity; pool->count++) {
+    pool->free[pool->count] = av_packet_alloc();
+    if (!pool->free[pool->count])
+      return -1;
+  }
+  return 0;
+}
+
+// Free the pool; every packet must have been given back
+static void packet_pool_free(t_packet_pool *pool) {
+  if (!pool->free)
+    return;
+  for (int i = 0; i < pool->count; i++)
+    av_packet_free(&pool->free[i]);
+  freebytes(pool->free, pool->capacity * sizeof(AVPacket *));
+  pool->free = NULL;
+  pool->count = 0;
+  pool->capacity = 0;
+}
+
+// Encoders with AV_CODEC_CAP_DR1 write their packets into the session's
+// buffer pool, so the payloads are reused rather than allocated per packet.
+// A packet that does not fit gets FFmpeg's own buffer and counts as a miss.
+static int pooled_encode_buffer(AVCodecContext *ctx, AVPacket *pkt,
+                                int flags) {
+  t_streamer *x = (t_streamer *)ctx->opaque;
+  if (!x->packet_buffers ||
+      pkt->size > x->packet_buffer_size - AV_INPUT_BUFFER_PADDING_SIZE) {
+    if (x->packet_buffers)
+      atomic_fetch_add_explicit(&x->pool_misses, 1, memory_order_relaxed);
+    return avcodec_default_get_encode_buffer(ctx, pkt, flags);
+  }
+  pkt->buf = av_buffer_pool_get(x->packet_buffers);
+  if (!pkt->buf)
+    return AVERROR(ENOMEM);
+  pkt->data = pkt->buf->data;
+  memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  return 0;
+}
+
+// Let the encoder take its packets from the buffer pool if it can
+static void use_pooled_encode_buffers(t_streamer *x, AVCodecContext *ctx) {
+  if (!(ctx->codec->capabilities & AV_CODEC_CAP_DR1))
+    return;
+  ctx->opaque = x;
+  ctx->get_encode_buffer = pooled_encode_buffer;
+}
+
+// Take a blank packet, or NULL if all are in use
+static AVPacket *packet_pool_get(t_packet_pool *pool) {
+  AVPacket *pkt = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->count > 0)
+    pkt = pool->free[--pool->count];
+  pthread_mutex_unlock(&pool->mutex);
+  return pkt;
+}
+
+// Release the packet's data and give it back
+static void packet_pool_put(t_packet_pool *pool, AVPacket *pkt) {
+  av_packet_unref(pkt);
+  pthread_mutex_lock(&pool->mutex);
+  pool->free[pool->count++] = pkt;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Output packet queue
+
+// Append a packet, taking ownership of it, and wake the writer. The queue is
+// bounded, so a stalled connection can never grow memory; when it is full
+// the policy decides which packet is lost. With QUEUE_BLOCK the encoder
+// stops taking audio while a queue is full (see outputs_backlogged), so a
+// full queue only loses the newest packet.
+static void output_queue_push(t_rtmp_output *out, AVPacket *pkt,
+                              t_queue_policy policy) {
+  AVPacket *dropped = NULL;
+  pthread_mutex_lock(&out->mutex);
+  if (out->queue_count == RTMP_OUTPUT_QUEUE_PACKETS) {
+    if (policy == QUEUE_DROP_OLDEST) {
+      dropped = out->queue[out->queue_head];
+      out->queue_head = (out->queue_head + 1) % RTMP_OUTPUT_QUEUE_PACKETS;
+      out->queue_count--;
+    } else {
+      dropped = pkt;
+      pkt = NULL;
+    }
+  }
+  if (pkt) {
+    int tail = (out->queue_head + out->queue_count) % RTMP_OUTPUT_QUEUE_PACKETS;
+    out->queue[tail] = pkt;
+    out->queue_count++;
+  }
+  atomic_store_explicit(&out->queue_fill, out->queue_count,
+                        memory_order_relaxed);
+  pthread_mutex_unlock(&out->mutex);
+
+  if (pkt)
+    pool_task_wake(&out->task);
+  if (dropped) {
+    packet_pool_put(&out->owner->packets, dropped);
+    atomic_fetch_add_explicit(&out->dropped_packets, 1, memory_order_relaxed);
+  }
+}
+
+// Take the oldest packet, or NULL if the queue is empty. Taking from a full
+// queue wakes the encoder, which may be holding back for it.
+static AVPacket *output_queue_pop(t_rtmp_output *out) {
+  AVPacket *pkt = NULL;
+  int was_full = 0;
+  pthread_mutex_lock(&out->mutex);
+  if (out->queue_count > 0) {
+    was_full = out->queue_count == RTMP_OUTPUT_QUEUE_PACKETS;
+    pkt = out->queue[out->queue_head];
+    out->queue_head = (out->queue_head + 1) % RTMP_OUTPUT_QUEUE_PACKETS;
+    out->queue_count--;
+  }
+  atomic_store_explicit(&out->queue_fill, out->queue_count,
+                        memory_order_relaxed);
+  pthread_mutex_unlock(&out->mutex);
+  if (was_full)
+    pool_task_wake(&out->owner->task);
+  return pkt;
+}
+
+// Nonzero once the writer has been told to quit and has written everything
+static int output_queue_drained(t_rtmp_output *out) {
+  pthread_mutex_lock(&out->mutex);
+  int drained = out->quit && out->queue_count == 0;
+  pthread_mutex_unlock(&out->mutex);
+  return drained;
+}
+
+// Drop every queued packet; they count as dropped
+static void output_queue_clear(t_rtmp_output *out) {
+  unsigned dropped = 0;
+  pthread_mutex_lock(&out->mutex);
+  while (out->queue_count > 0) {
+    packet_pool_put(&out->owner->packets, out->queue[out->queue_head]);
+    out->queue_head = (out->queue_head + 1) % RTMP_OUTPUT_QUEUE_PACKETS;
+    out->queue_count--;
+    dropped++;
+  }
+  atomic_store_explicit(&out->queue_fill, 0, memory_order_relaxed);
+  pthread_mutex_unlock(&out->mutex);
+  if (dropped)
+    atomic_fetch_add_explicit(&out->dropped_packets, dropped,
+                              memory_order_relaxed);
+}
+
+// Hand a packet of rendition r to every connected output that carries it,
+// tagged with the output's stream index. Each output gets a pooled packet
+// referencing the same data; nothing is copied. A main stream packet the
+// output already had from another rung is skipped, so switching rungs never
+// sends timestamps backwards. Called for different renditions in parallel;
+// each output's main stream is fed by one of them at a time.
+static void dispatch_packet(t_streamer *x, const AVPacket *pkt, int r) {
+  t_queue_policy policy = x->policy;
+  for (int i = 0; i < x->num_outputs; i++) {
+    t_rtmp_output *out = &x->outputs[i];
+    int stream = out->rung == r ? 0 : out->extra_stream[r];
+    if ((stream == 0 && out->rung != r) ||
+        atomic_load(&out->state) != STREAM_STREAMING)
+      continue;
+    if (stream == 0 && pkt->pts != AV_NOPTS_VALUE) {
+      if (out->next_pts != AV_NOPTS_VALUE && pkt->pts < out->next_pts)
+        continue;
+      out->next_pts = pkt->pts + pkt->duration;
+    }
+
+    AVPacket *ref = packet_pool_get(&x->packets);
+    if (!ref) {
+      atomic_fetch_add_explicit(&x->pool_misses, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&out->dropped_packets, 1, memory_order_relaxed);
+      continue;
+    }
+    if (av_packet_ref(ref, pkt) < 0) {
+      packet_pool_put(&x->packets, ref);
+      atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+      continue;
+    }
+    ref->stream_index = stream;
+    output_queue_push(out, ref, policy);
+  }
+}
+
+// Free the stream monitor's decoder and resampler
+static void close_monitor(t_streamer *x) {
+  avcodec_free_context(&x->monitor_dec);
+  swr_free(&x->monitor_swr);
+  av_frame_free(&x->monitor_frame);
+  if (x->monitor_buf) {
+    freebytes(x->monitor_buf, RTMP_RESAMPLE_CHUNK * sizeof(float));
+    x->monitor_buf = NULL;
+  }
+}
+
+// Open the decoder for the stream monitor. Worker thread only. A failure is
+// reported once per session and not retried.
+static int open_monitor(t_streamer *x) {
+  if (x->monitor_failed)
+    return -1;
+
+  const AVCodec *codec = avcodec_find_decoder(x->codec_ctx->codec_id);
+  x->monitor_dec = codec ? avcodec_alloc_context3(codec) : NULL;
+  if (x->monitor_dec) {
+    x->monitor_dec->sample_rate = x->codec_ctx->sample_rate;
+    x->monitor_dec->time_base = x->codec_ctx->time_base;
+    av_channel_layout_copy(&x->monitor_dec->ch_layout,
+                           &x->codec_ctx->ch_layout);
+    // AAC and Opus decoders need the encoder's configuration header
+    if (x->codec_ctx->extradata_size > 0) {
+      x->monitor_dec->extradata = (uint8_t *)av_mallocz(
+          x->codec_ctx->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+      if (x->monitor_dec->extradata) {
+        memcpy(x->monitor_dec->extradata, x->codec_ctx->extradata,
+               x->codec_ctx->extradata_size);
+        x->monitor_dec->extradata_size = x->codec_ctx->extradata_size;
+      }
+    }
+  }
+  if (!x->monitor_dec || avcodec_open2(x->monitor_dec, codec, NULL) < 0 ||
+      !(x->monitor_frame = av_frame_alloc()) ||
+      !(x->monitor_buf =
+            (float *)getbytes(RTMP_RESAMPLE_CHUNK * sizeof(float)))) {
+    streaming_error(x, "[rtmpstreamer~] Could not open %s decoder for the "
+                       "stream monitor",
+                    x->codec->name);
+    close_monitor(x);
+    x->monitor_failed = 1;
+    return -1;
+  }
+
+  // Enough to cover two encoder frames at Pd's rate, plus one block
+  int64_t frames = (int64_t)x->frame_capacity * 2 * x->in_rate /
+                   x->codec_ctx->sample_rate;
+  atomic_store(&x->monitor_prebuffer,
+               (int)frames + atomic_load(&x->block_size));
+  return 0;
+}
+
+// Decode an encoded packet into the monitor ring, so the outlet plays what
+// the audience hears. Only done while the monitor is selected. Worker
+// thread only.
+static void monitor_packet(t_streamer *x, const AVPacket *pkt) {
+  if (atomic_load_explicit(&x->monitor, memory_order_relaxed) !=
+      MONITOR_STREAM)
+    return;
+  if (!x->monitor_dec && open_monitor(x) < 0)
+    return;
+
+  if (avcodec_send_packet(x->monitor_dec, pkt) < 0)
+    return;
+  AVFrame *frame = x->monitor_frame;
+  while (avcodec_receive_frame(x->monitor_dec, frame) >= 0) {
+    if (!x->monitor_swr) {
+      // Mix down to mono float at Pd's current rate
+      AVChannelLayout mono;
+      av_channel_layout_default(&mono, 1);
+      if (swr_alloc_set_opts2(&x->monitor_swr, &mono, AV_SAMPLE_FMT_FLT,
+                              x->in_rate, &frame->ch_layout,
+                              (enum AVSampleFormat)frame->format,
+                              frame->sample_rate, 0, NULL) < 0 ||
+          swr_init(x->monitor_swr) < 0) {
+        swr_free(&x->monitor_swr);
+        av_frame_unref(frame);
+        break;
+      }
+    }
+
+    // in_count 0 with a non-NULL input drains without flushing
+    const uint8_t **in = (const uint8_t **)frame->extended_data;
+    int in_count = frame->nb_samples;
+    for (;;) {
+      uint8_t *out = (uint8_t *)x->monitor_buf;
+      int ret = swr_convert(x->monitor_swr, &out, RTMP_RESAMPLE_CHUNK, in,
+                            in_count);
+      if (ret <= 0)
+        break;
+      // If the outlet is not being played the ring fills up; the rest is
+      // dropped
+      ring_buffer_write(&x->monitor_ring, &x->monitor_buf, ret);
+      in_count = 0;
+      if (ret < RTMP_RESAMPLE_CHUNK)
+        break;
+    }
+    av_frame_unref(frame);
+  }
+}
+
+// Point x->frame at the next pooled frame the encoder no longer references.
+// If the encoder still holds all of them, the current one is made writable
+// by copying, which allocates; that counts as a pool miss.
+static int next_pooled_frame(t_streamer *x) {
+  for (int i = 0; i < RTMP_FRAME_POOL; i++) {
+    x->frame_index = (x->frame_index + 1) % RTMP_FRAME_POOL;
+    if (av_frame_is_writable(x->frames[x->frame_index]))
+      break;
+    if (i == RTMP_FRAME_POOL - 1)
+      atomic_fetch_add_explicit(&x->pool_misses, 1, memory_order_relaxed);
+  }
+  x->frame = x->frames[x->frame_index];
+  x->frame->nb_samples = x->frame_capacity;
+  return av_frame_make_writable(x->frame);
+}
+
+// Encode one frame with one rendition and dispatch the resulting packets.
+// Passing NULL flushes the encoder.
+static void encode_rendition(t_rendition *rd, AVFrame *frame) {
+  t_streamer *x = rd->owner;
+
+  // Send the frame to the encoder
+  int ret = avcodec_send_frame(rd->ctx, frame);
+  if (ret < 0) {
+    atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+    return;
+  }
+
+  // Receive packets from the encoder
+  while (ret >= 0) {
+    ret = avcodec_receive_packet(rd->ctx, rd->packet);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      break;
+    else if (ret < 0) {
+      atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+      break;
+    }
+
+    dispatch_packet(x, rd->packet, rd->index);
+    if (rd->index == 0)
+      monitor_packet(x, rd->packet);
+    av_packet_unref(rd->packet);
+  }
+}
+
+// Encode the rendition's pending frame if nobody has picked it up yet
+static void run_rendition_job(t_rendition *rd) {
+  int ready = JOB_READY;
+  if (!atomic_compare_exchange_strong(&rd->job, &ready, JOB_CLAIMED))
+    return;
+  encode_rendition(rd, rd->frame);
+  t_streamer *x = rd->owner;
+  pthread_mutex_lock(&x->rendition_mutex);
+  atomic_store(&rd->job, JOB_DONE);
+  pthread_cond_broadcast(&x->rendition_done);
+  pthread_mutex_unlock(&x->rendition_mutex);
+}
+
+// Rendition task: encodes the frame it was woken for
+static int rendition_step(t_pool_task *task) {
+  run_rendition_job((t_rendition *)task->owner);
+  return POOL_TASK_IDLE;
+}
+
+// Encode one frame with every rendition and dispatch the resulting packets.
+// Passing NULL flushes the encoders. The other renditions are handed to
+// their tasks while the main one is encoded here; whatever no pool thread
+// has started by then is encoded here too, so the encoder only ever waits
+// for work that is already running. Worker thread only.
+static void encode_frame(t_streamer *x, AVFrame *frame) {
+  int64_t start = av_gettime_relative();
+
+  for (int r = 1; r < x->num_renditions; r++) {
+    t_rendition *rd = &x->renditions[r];
+    rd->frame = frame;
+    atomic_store(&rd->job, JOB_READY);
+    pool_task_wake(&rd->task);
+  }
+  encode_rendition(&x->renditions[0], frame);
+  for (int r = 1; r < x->num_renditions; r++)
+    run_rendition_job(&x->renditions[r]);
+  if (x->num_renditions > 1) {
+    pthread_mutex_lock(&x->rendition_mutex);
+    for (int r = 1; r < x->num_renditions; r++)
+      while (atomic_load(&x->renditions[r].job) != JOB_DONE)
+        pthread_cond_wait(&x->rendition_done, &x->rendition_mutex);
+    pthread_mutex_unlock(&x->rendition_mutex);
+    for (int r = 1; r < x->num_renditions; r++)
+      atomic_store(&x->renditions[r].job, JOB_IDLE);
+  }
+  if (frame)
+    latency_stat_add(&x->encode_latency, start);
+}
+
+// Submit the accumulated frame to the encoder and start a new one
+static void submit_accumulated_frame(t_streamer *x) {
+  if (x->convert) {
+    // Convert the float staging planes into the codec's sample format
+    if (next_pooled_frame(x) < 0) {
+      atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+      x->frame_fill = 0;
+      return;
+    }
+    float *planes[RTMP_MAX_CHANNELS];
+    for (int ch = 0; ch < x->channels; ch++)
+      planes[ch] = x->staging + ch * x->frame_capacity;
+    x->convert(x->frame->extended_data, planes, x->channels, x->frame_fill);
+  }
+
+  x->frame->nb_samples = x->frame_fill;
+  x->frame->pts = x->pts;
+  x->pts += x->frame_fill;
+  x->frame_fill = 0;
+
+  encode_frame(x, x->frame);
+}
+
+// Planes the accumulator fills for the current frame: float planar codecs
+// (AAC) are filled directly, one plane per channel; anything else is staged
+// as float planes and converted on submit. Returns NULL if the frame cannot
+// be written to.
+static float **accumulator_planes(t_streamer *x, float **staged) {
+  if (x->convert) {
+    for (int ch = 0; ch < x->channels; ch++)
+      staged[ch] = x->staging + ch * x->frame_capacity;
+    return staged;
+  }
+  if (x->frame_fill == 0) {
+    // The encoder may still hold a reference to the previous buffer
+    if (next_pooled_frame(x) < 0) {
+      atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+      return NULL;
+    }
+  }
+  return (float **)x->frame->extended_data;
+}
+
+// Ring position of the next sample the encoder will consume. The pre-roll
+// holds the newest samples taken out of the ring, so they come just before
+// the ring's read position.
+static size_t source_position(t_streamer *x) {
+  return atomic_load_explicit(&x->ring.tail, memory_order_relaxed) -
+         x->preroll.count;
+}
+
+// Read captured audio at Pd's rate: first what is held in the pre-roll,
+// then what is still queued in the ring
+static size_t source_read(t_streamer *x, float *const *planes,
+                          size_t offset, size_t n) {
+  // Stop at a pending sample rate change, so samples on either side of it
+  // never go through the same resampler call
+  if (atomic_load_explicit(&x->pending_rate, memory_order_acquire)) {
+    size_t next = source_position(x);
+    size_t change = atomic_load(&x->pending_rate_pos);
+    if (change - next < n) // Wraps, so no limit, once the change is passed
+      n = change - next;
+  }
+
+  size_t got = preroll_buffer_read(&x->preroll, planes, offset, n);
+  if (got < n)
+    got += ring_buffer_read(&x->ring, planes, offset + got, n - got);
+  return got;
+}
+
+// Read up to n samples at the stream's rate through the resampler. Output
+// the resampler already holds is used first; more input is pulled from the
+// source only while that is not enough. Returns less than n only once the
+// source is drained.
+static size_t resample_read(t_streamer *x, float *const *planes,
+                            size_t offset, size_t n) {
+  uint8_t *out[RTMP_MAX_CHANNELS];
+  const uint8_t *in[RTMP_MAX_CHANNELS];
+  float *in_planes[RTMP_MAX_CHANNELS];
+  for (int ch = 0; ch < x->channels; ch++) {
+    in_planes[ch] = x->resample_in + ch * RTMP_RESAMPLE_CHUNK;
+    in[ch] = (const uint8_t *)in_planes[ch];
+  }
+
+  size_t produced = 0;
+  size_t got = 0;
+  do {
+    for (int ch = 0; ch < x->channels; ch++)
+      out[ch] = (uint8_t *)(planes[ch] + offset + produced);
+    // in_count 0 only drains buffered output; a NULL input would flush
+    int ret = swr_convert(x->resampler, out, (int)(n - produced), in,
+                          (int)got);
+    if (ret < 0) {
+      atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+      break;
+    }
+    produced += (size_t)ret;
+    if (produced == n)
+      break;
+    got = source_read(x, in_planes, 0, RTMP_RESAMPLE_CHUNK);
+  } while (got > 0);
+  return produced;
+}
+
+// Estimate the samples between capture and the encoded packet: one Pd block,
+// one encoder frame, the resampler's and the encoder's lookahead, plus the
+// worker's sleep. Packets waiting in the output queues come on top; the
+// stats report adds them.
+static void update_pipeline_latency(t_streamer *x) {
+  int64_t rate = x->codec_ctx->sample_rate;
+  int64_t us = (int64_t)atomic_load(&x->block_size) * 1000000 /
+               (x->in_rate > 0 ? x->in_rate : rate);
+  int delay = x->frame_capacity + x->codec_ctx->initial_padding;
+  if (x->resampler)
+    delay += (int)swr_get_delay(x->resampler, rate);
+  us += (int64_t)delay * 1000000 / rate;
+  atomic_store(&x->pipeline_latency_us, (int)us + x->poll_ms * 1000);
+  atomic_store(&x->frame_us,
+               (int)((int64_t)x->frame_capacity * 1000000 / rate));
+}
+
+// Set up resampling from in_rate to the encoder's rate; none is needed if
+// they match. Worker thread only.
+static int open_resampler(t_streamer *x, int in_rate) {
+  x->in_rate = in_rate;
+  if (in_rate == x->codec_ctx->sample_rate)
+    return 0;
+
+  if (swr_alloc_set_opts2(&x->resampler, &x->codec_ctx->ch_layout,
+                          AV_SAMPLE_FMT_FLTP, x->codec_ctx->sample_rate,
+                          &x->codec_ctx->ch_layout, AV_SAMPLE_FMT_FLTP, in_rate,
+                          0, NULL) < 0 ||
+      swr_init(x->resampler) < 0) {
+    streaming_error(x, "[rtmpstreamer~] Could not resample %d Hz to %d Hz",
+                    in_rate, x->codec_ctx->sample_rate);
+    swr_free(&x->resampler);
+    return -1;
+  }
+  if (!x->resample_in) {
+    x->resample_in = (float *)getbytes(RTMP_RESAMPLE_CHUNK * x->channels *
+                                       sizeof(float));
+    if (!x->resample_in) {
+      streaming_error(x, "[rtmpstreamer~] Could not allocate resampler buffer");
+      swr_free(&x->resampler);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Push the resampler's tail into the accumulator, encoding full frames
+static void drain_resampler(t_streamer *x) {
+  while (x->resampler) {
+    float *staged[RTMP_MAX_CHANNELS];
+    float **planes = accumulator_planes(x, staged);
+    if (!planes)
+      break;
+    uint8_t *out[RTMP_MAX_CHANNELS];
+    for (int ch = 0; ch < x->channels; ch++)
+      out[ch] = (uint8_t *)(planes[ch] + x->frame_fill);
+    int ret = swr_convert(x->resampler, out,
+                          x->frame_capacity - x->frame_fill, NULL, 0);
+    if (ret <= 0)
+      break;
+    x->frame_fill += ret;
+    if (x->frame_fill == x->frame_capacity)
+      submit_accumulated_frame(x);
+  }
+}
+
+// Switch to a new Pd sample rate once every sample at the old rate has been
+// consumed. The stream keeps its rate and timeline, so the connections are
+// not touched; only the resampler is replaced.
+static void apply_pending_rate(t_streamer *x) {
+  int rate = atomic_load_explicit(&x->pending_rate, memory_order_acquire);
+  if (!rate)
+    return;
+  // The pre-roll may have dropped the change position itself when it
+  // overflowed, so anything at or past it counts as reached
+  size_t passed = source_position(x) - atomic_load(&x->pending_rate_pos);
+  if (passed > SIZE_MAX / 2)
+    return;
+
+  drain_resampler(x);
+  swr_free(&x->resampler);
+  swr_free(&x->monitor_swr); // Reopened for the new rate by the next frame
+  if (open_resampler(x, rate) < 0)
+    atomic_fetch_add_explicit(&x->encode_errors, 1, memory_order_relaxed);
+  update_pipeline_latency(x);
+  // A newer change may have arrived meanwhile; it is picked up next time
+  atomic_compare_exchange_strong(&x->pending_rate, &rate, 0);
+}
+
+// With QUEUE_BLOCK: nonzero while a connected output's queue is full. The
+// encoder then leaves the audio in the ring until the writer catches up.
+static int outputs_backlogged(t_streamer *x) {
+  if (x->policy != QUEUE_BLOCK)
+    return 0;
+  for (int i = 0; i < x->num_outputs; i++) {
+    t_rtmp_output *out = &x->outputs[i];
+    if (atomic_load(&out->state) == STREAM_STREAMING &&
+        atomic_load_explicit(&out->queue_fill, memory_order_relaxed) ==
+            RTMP_OUTPUT_QUEUE_PACKETS)
+      return 1;
+  }
+  return 0;
+}
+
+// Tell the Pd clock which bitrate output i is streaming at now
+static void report_bit_rate(t_streamer *x, int i) {
+  t_message reply = {REPLY_BITRATE, i, 0, ""};
+  reply.value = (int)x->renditions[x->outputs[i].rung].ctx->bit_rate;
+  message_queue_push(&x->replies, &reply);
+}
+
+// Adaptive bitrate rungs of the renditions: the highest-rate rendition below
+// rendition r, and the lowest-rate one above it but at most at rendition
+// limit's rate. -1 if there is none.
+static int rung_below(t_streamer *x, int r) {
+  int64_t rate = x->renditions[r].ctx->bit_rate;
+  int best = -1;
+  for (int i = 0; i < x->num_renditions; i++) {
+    int64_t b = x->renditions[i].ctx->bit_rate;
+    if (b < rate && (best < 0 || b > x->renditions[best].ctx->bit_rate))
+      best = i;
+  }
+  return best;
+}
+
+static int rung_above(t_streamer *x, int r, int limit) {
+  int64_t rate = x->renditions[r].ctx->bit_rate;
+  int64_t max = x->renditions[limit].ctx->bit_rate;
+  int best = -1;
+  for (int i = 0; i < x->num_renditions; i++) {
+    int64_t b = x->renditions[i].ctx->bit_rate;
+    if (b > rate && b <= max &&
+        (best < 0 || b < x->renditions[best].ctx->bit_rate))
+      best = i;
+  }
+  return best;
+}
+
+// Adaptive bitrate: once per interval, move each network output one rung
+// down if its queue is filling, it dropped packets or writing a packet took
+// longer than the audio it holds (the connection is slower than the
+// bitrate), and one rung up after a run of intervals with an almost empty
+// queue and quick writes, never above its own rendition. The archive and
+// outputs carrying several renditions keep theirs.
+static void adapt_bitrate(t_streamer *x) {
+  int64_t now = av_gettime_relative();
+  if (!x->abr || x->num_renditions < 2 || now < x->abr_next)
+    return;
+  x->abr_next = now + RTMP_ABR_INTERVAL_MS * 1000;
+
+  t_float frame_ms = 1000.0f * x->frame_capacity / x->codec_ctx->sample_rate;
+  for (int i = 0; i < x->num_outputs; i++) {
+    t_rtmp_output *out = &x->outputs[i];
+    if (out->archive || out->num_streams > 1)
+      continue;
+    t_float mean_ms, max_ms;
+    latency_stat_take(&out->abr_latency, &mean_ms, &max_ms);
+    unsigned dropped = atomic_load(&out->dropped_packets);
+    int fill = atomic_load_explicit(&out->queue_fill, memory_order_relaxed);
+    int congested = dropped != out->abr_dropped ||
+                    fill > RTMP_ABR_HIGH_WATER || mean_ms > frame_ms;
+    int calm = fill <= RTMP_ABR_LOW_WATER && mean_ms < frame_ms / 2;
+    out->abr_dropped = dropped;
+
+    if (atomic_load(&out->state) != STREAM_STREAMING || !calm)
+      out->abr_calm = 0;
+    if (atomic_load(&out->state) != STREAM_STREAMING)
+      continue;
+
+    int rung = -1;
+    if (congested)
+      rung = rung_below(x, out->rung);
+    else if (calm && out->rung != out->rendition &&
+             ++out->abr_calm >= RTMP_ABR_CALM_INTERVALS)
+      rung = rung_above(x, out->rung, out->rendition);
+    if (rung >= 0) {
+      out->rung = rung;
+      out->abr_calm = 0;
+      report_bit_rate(x, i);
+    }
+  }
+}
+
+// Accumulate Pd blocks into codec-sized frames, so the encoder is called once
+// per frame_size samples rather than once per block. Audio held in the
+// pre-roll goes out before anything still queued in the ring. Unless
+// flushing, stops early while the outputs are backlogged. While paused the
+// audio is still read at the same pace, then silenced, or dropped by
+// reading it over the unused part of the frame.
+// Returns nonzero if any audio was consumed.
+static int streaming_worker_process(t_streamer *x, int flushing) {
+  int did_work = 0;
+
+  while (x->preroll.count > 0 || ring_buffer_available(&x->ring) > 0) {
+    if (!flushing && x->pause != PAUSE_NOTHING && outputs_backlogged(x))
+      break;
+    apply_pending_rate(x);
+
+    float *staged[RTMP_MAX_CHANNELS];
+    float **planes = accumulator_planes(x, staged);
+    if (!planes)
+      break;
+
+    size_t wanted = x->frame_capacity - x->frame_fill;
+    size_t got = x->resampler
+                     ? resample_read(x, planes, x->frame_fill, wanted)
+                     : source_read(x, planes, x->frame_fill, wanted);
+    if (x->pause == PAUSE_SILENCE)
+      for (int ch = 0; ch < x->channels; ch++)
+        memset(planes[ch] + x->frame_fill, 0, got * sizeof(float));
+    if (x->pause != PAUSE_NOTHING)
+      x->frame_fill += (int)got;
+    did_work = 1;
+
+    if (x->frame_fill == x->frame_capacity)
+      submit_accumulated_frame(x);
+  }
+  return did_work;
+}
+
+// Encode whatever is left in the ring, the resampler and the accumulator,
+// then drain the encoder so the tail of the stream is not lost when
+// streaming stops.
+static void streaming_worker_flush(t_streamer *x) {
+  streaming_worker_process(x, 1);
+  if (x->pause != PAUSE_NOTHING)
+    drain_resampler(x);
+  if (x->frame_fill > 0)
+    submit_accumulated_frame(x);
+  encode_frame(x, NULL);
+}
+
+// Record an error raised on a worker thread. pd_error is not thread-safe,
+// so the message is queued for the Pd clock to print.
+static void streaming_error(t_streamer *x, const char *fmt, ...) {
+  t_message reply = {REPLY_ERROR, -1, 0, ""};
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(reply.text, sizeof(reply.text), fmt, ap);
+  va_end(ap);
+  message_queue_push(&x->replies, &reply);
+}
+
+// FFmpeg interrupt callback of an output: aborts a blocking call that runs
+// past its own deadline, and any call once a stop times out
+static int streaming_interrupt_cb(void *opaque) {
+  t_rtmp_output *out = (t_rtmp_output *)opaque;
+  int64_t now = av_gettime_relative();
+  int64_t call = atomic_load(&out->io_deadline);
+  int64_t stop = atomic_load(&out->owner->abort_deadline);
+  return (call != 0 && now >= call) || (stop != 0 && now >= stop);
+}
+
+// Give the writer's next blocking FFmpeg call ms milliseconds
+static void arm_io_deadline(t_rtmp_output *out, int ms) {
+  atomic_store(&out->io_deadline, av_gettime_relative() + ms * 1000LL);
+}
+
+// Switch the pause mode. Before packets stop, the frame being filled is
+// completed with silence and sent, so the audio up to the pause goes out
+// and the frames after the resume start at the next timestamp.
+static void streaming_worker_pause(t_streamer *x, t_pause_mode mode) {
+  if (mode == PAUSE_NOTHING && x->pause != PAUSE_NOTHING &&
+      x->frame_fill > 0) {
+    float *staged[RTMP_MAX_CHANNELS];
+    float **planes = accumulator_planes(x, staged);
+    if (planes) {
+      for (int ch = 0; ch < x->channels; ch++)
+        memset(planes[ch] + x->frame_fill, 0,
+               (x->frame_capacity - x->frame_fill) * sizeof(float));
+      x->frame_fill = x->frame_capacity;
+      submit_accumulated_frame(x);
+    }
+  }
+  x->pause = mode;
+}
+
+// Apply the commands the Pd thread has sent since the last step. Returns
+// nonzero once the session has been asked to stop.
+static int streaming_worker_commands(t_streamer *x) {
+  t_message cmd;
+  if (atomic_load(&x->stop_requested))
+    x->worker_quit = 1;
+  while (message_queue_pop(&x->commands, &cmd) == 0) {
+    if (cmd.type == CMD_STOP)
+      x->worker_quit = 1;
+    else if (cmd.type == CMD_OVERFLOW)
+      x->policy = (t_queue_policy)cmd.value;
+    else if (cmd.type == CMD_PAUSE)
+      streaming_worker_pause(x, (t_pause_mode)cmd.value);
+  }
+  return x->worker_quit;
+}
+
+// Nonzero if at least one output is connected and taking packets
+static int any_output_streaming(t_streamer *x) {
+  for (int i = 0; i < x->num_outputs; i++)
+    if (atomic_load(&x->outputs[i].state) == STREAM_STREAMING)
+      return 1;
+  return 0;
+}
+
+// Write queued packets until the queue is empty or the session breaks
+static void output_writer_run(t_streamer *x, t_rtmp_output *out) {
+  AVPacket *pkt;
+  while ((pkt = output_queue_pop(out)) != NULL) {
+    // The encoder tagged the packet with its stream's index
+    AVStream *st = out->fmt_ctx->streams[pkt->stream_index];
+    av_packet_rescale_ts(pkt, x->codec_ctx->time_base, st->time_base);
+
+    // Write the compressed frame to the media file. With a single stream
+    // there is nothing to interleave, so low-latency mode skips the queue
+    int size = pkt->size;
+    int64_t start = av_gettime_relative();
+    arm_io_deadline(out, RTMP_WRITE_TIMEOUT_MS);
+    int ret = out->direct_write ? av_write_frame(out->fmt_ctx, pkt)
+                                : av_interleaved_write_frame(out->fmt_ctx, pkt);
+    latency_stat_add(&x->write_latency, start);
+    latency_stat_add(&out->abr_latency, start);
+    packet_pool_put(&x->packets, pkt);
+    if (ret < 0) {
+      // The connection is gone; let the writer reconnect
+      atomic_fetch_add_explicit(&x->write_errors, 1, memory_order_relaxed);
+      streaming_error(x, "[rtmpstreamer~] Error while writing to '%s': %s",
+                      out->url->s_name, av_err2str(ret));
+      out->session_failed = 1;
+      return;
+    }
+    atomic_fetch_add_explicit(&x->bytes_written, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&x->packets_written, 1, memory_order_relaxed);
+  }
+}
+
+// End an output's writer task in the given state
+static int output_writer_finish(t_rtmp_output *out, t_stream_state state) {
+  output_queue_clear(out);
+  atomic_store(&out->state, state);
+  return POOL_TASK_DONE;
+}
+
+// The pool is done with a writer task. The last writer to finish wakes the
+// encoder task, which may be waiting to complete a stop. The writer's own
+// reference keeps the streamer until then, even if the session ends first.
+static void output_writer_finished(t_pool_task *task) {
+  t_streamer *x = ((t_rtmp_output *)task->owner)->owner;
+  if (atomic_fetch_sub(&x->writers_running, 1) == 1)
+    pool_task_wake(&x->task);
+  streamer_release(x);
+}
+
+// Output writer task: connects, then writes packets whenever the encoder
+// queues some, until told to quit. Failed or dropped connections are retried
+// with exponential backoff, independently of the other outputs.
+static int output_writer_step(t_pool_task *task) {
+  t_rtmp_output *out = (t_rtmp_output *)task->owner;
+  t_streamer *x = out->owner;
+
+  if (!out->connected) {
+    if (output_queue_drained(out))
+      return output_writer_finish(out, STREAM_IDLE);
+
+    // Connect without holding up the encoder or the other outputs
+    atomic_store(&out->state, STREAM_CONNECTING);
+    out->session_failed = 0;
+    if (open_output(x, out) < 0) {
+      close_output(out);
+      if (!atomic_load(&x->reconnect))
+        return output_writer_finish(out, STREAM_ERROR);
+      atomic_store(&out->state, STREAM_RECONNECTING);
+      int delay = out->backoff_ms;
+      out->backoff_ms *= 2;
+      if (out->backoff_ms > RTMP_RECONNECT_MAX_MS)
+        out->backoff_ms = RTMP_RECONNECT_MAX_MS;
+      return delay;
+    }
+
+    if (out->reconnecting)
+      atomic_fetch_add(&x->reconnects, 1);
+    out->reconnecting = 0;
+    out->connected = 1;
+    out->backoff_ms = RTMP_RECONNECT_MIN_MS;
+    atomic_store(&out->state, STREAM_STREAMING);
+  }
+
+  output_writer_run(x, out);
+  if (out->session_failed) {
+    // The connection dropped; packets queued for it are stale by now
+    atomic_store(&out->state, STREAM_RECONNECTING);
+    close_output(out);
+    output_queue_clear(out);
+    out->connected = 0;
+    out->reconnecting = 1;
+    if (!atomic_load(&x->reconnect))
+      return output_writer_finish(out, STREAM_ERROR);
+    return out->backoff_ms;
+  }
+  if (output_queue_drained(out)) {
+    // Orderly stop: the queue has been drained, finish the stream
+    close_output(out);
+    return output_writer_finish(out, STREAM_IDLE);
+  }
+  return POOL_TASK_IDLE; // Woken by the next packet or the stop
+}
+
+// Start the writer task of one output
+static void start_output_writer(t_rtmp_output *out) {
+  out->quit = 0;
+  out->queue_head = 0;
+  out->queue_count = 0;
+  out->connected = 0;
+  out->reconnecting = 0;
+  out->backoff_ms = RTMP_RECONNECT_MIN_MS;
+  t_streamer *x = out->owner;
+  out->rung = out->rendition;
+  out->next_pts = AV_NOPTS_VALUE;
+  latency_stat_init(&out->abr_latency);
+  out->abr_dropped = atomic_load(&out->dropped_packets);
+  out->abr_calm = 0;
+  if (x->abr && x->num_renditions > 1 && !out->archive &&
+      out->num_streams == 1)
+    report_bit_rate(x, (int)(out - x->outputs));
+  atomic_store(&out->state, STREAM_CONNECTING);
+  atomic_fetch_add(&x->refs, 1);
+  pool_task_start(&out->task);
+}
+
+// Let the writer drain its queue, close the connection and finish
+static void stop_output_writer(t_rtmp_output *out) {
+  pthread_mutex_lock(&out->mutex);
+  out->quit = 1;
+  pthread_mutex_unlock(&out->mutex);
+  pool_task_wake(&out->task);
+}
+
+// Streamer
+
+// Free the destinations. No session may be running.
+static void free_outputs(t_streamer *x) {
+  for (int i = 0; i < x->num_outputs; i++)
+    pthread_mutex_destroy(&x->outputs[i].mutex);
+  if (x->outputs)
+    freebytes(x->outputs, x->num_outputs * sizeof(t_rtmp_output));
+  x->outputs = NULL;
+  x->num_outputs = 0;
+}
+
+// Drop a reference; the last one frees the streamer. Runs on the Pd thread
+// when the object goes, or on a pool thread when a session outlives it.
+static void streamer_release(t_streamer *x) {
+  if (atomic_fetch_sub(&x->refs, 1) != 1)
+    return;
+  free_outputs(x);
+  preroll_buffer_free(&x->preroll);
+  pthread_mutex_destroy(&x->packets.mutex);
+  pthread_mutex_destroy(&x->rendition_mutex);
+  pthread_cond_destroy(&x->rendition_done);
+  ring_buffer_free(&x->ring);
+  ring_buffer_free(&x->monitor_ring);
+  freebytes(x, sizeof(t_streamer));
+}
+
+// Streaming worker task: opens the encoder and starts one writer per output,
+// then drains the ring buffer, encodes and dispatches packets until told to
+// quit. While no output is connected, incoming audio is kept in the pre-roll
+// instead of being encoded.
+static int streaming_worker_step(t_pool_task *task) {
+  t_streamer *x = (t_streamer *)task->owner;
+
+  switch (x->worker_phase) {
+  case WORKER_SETUP:
+    if (initialize_streaming(x) < 0) {
+      cleanup_streaming(x);
+      for (int i = 0; i < x->num_outputs; i++)
+        atomic_store(&x->outputs[i].state, STREAM_ERROR);
+      atomic_store_explicit(&x->streaming_active, 0, memory_order_release);
+      return POOL_TASK_DONE;
+    }
+    atomic_store(&x->writers_running, x->num_outputs);
+    for (int i = 0; i < x->num_outputs; i++)
+      start_output_writer(&x->outputs[i]);
+    x->worker_phase = WORKER_RUNNING;
+    // Fall through
+
+  case WORKER_RUNNING:
+    if (!streaming_worker_commands(x)) {
+      int did_work = 0;
+      adapt_bitrate(x);
+      // Paused audio is never kept for later
+      if (any_output_streaming(x) || x->pause != PAUSE_OFF)
+        did_work = streaming_worker_process(x, 0);
+      else
+        preroll_buffer_fill(&x->preroll, &x->ring);
+      // Nothing to do: look again once the DSP thread has produced more
+      return did_work ? 0 : x->poll_ms;
+    }
+
+    // Orderly stop: send the tail of the stream, then let every writer
+    // drain its queue and finish its stream
+    if (any_output_streaming(x))
+      streaming_worker_flush(x);
+    for (int i = 0; i < x->num_outputs; i++)
+      stop_output_writer(&x->outputs[i]);
+    x->worker_phase = WORKER_STOPPING;
+    // Fall through
+
+  case WORKER_STOPPING:
+    if (atomic_load(&x->writers_running) > 0)
+      return POOL_TASK_IDLE; // The last writer to finish wakes us
+    cleanup_streaming(x);
+    atomic_store_explicit(&x->streaming_active, 0, memory_order_release);
+    return POOL_TASK_DONE;
+  }
+  return POOL_TASK_DONE;
+}
+
+// The pool is done with the encoder task, so the session is over: tell the
+// Pd clock, and drop the session's reference to the streamer. If the object
+// has been freed meanwhile, that frees the streamer.
+static void streaming_worker_finished(t_pool_task *task) {
+  t_streamer *x = (t_streamer *)task->owner;
+  t_message reply = {REPLY_STOPPED, -1, x->session, ""};
+  atomic_store(&x->worker_exited, 1);
+  message_queue_push(&x->replies, &reply);
+  streamer_release(x);
+  worker_pool_release();
+}
+
+// Allocate the streaming state of an object with n channels, including the
+// hand-off buffers, so the DSP thread never allocates. NULL on failure.
+static t_streamer *streamer_new(int channels) {
+  t_streamer *x = (t_streamer *)getbytes(sizeof(t_streamer));
+  if (!x)
+    return NULL;
+  atomic_init(&x->refs, 1);
+  x->session = 0;
+  x->outputs = NULL;
+  x->num_outputs = 0;
+  x->channels = channels;
+  x->codec = &codec_descs[0];
+  x->bit_rate = 0;
+  x->low_latency = 0;
+  x->abr = 0;
+  x->ladder_size = 0;
+  x->abr_next = 0;
+  x->out_rate = 0;
+  x->resampler = NULL;
+  x->resample_in = NULL;
+  x->in_rate = 0;
+  x->start_rate = 0;
+  atomic_init(&x->pending_rate, 0);
+  atomic_init(&x->pending_rate_pos, 0);
+  x->poll_ms = RTMP_WORKER_POLL_MS;
+  atomic_init(&x->block_size, 64);
+  atomic_init(&x->pipeline_latency_us, 0);
+  atomic_init(&x->frame_us, 0);
+
+  x->codec_ctx = NULL;
+  for (int i = 0; i < RTMP_MAX_RENDITIONS; i++) {
+    t_rendition *rd = &x->renditions[i];
+    rd->owner = x;
+    rd->index = i;
+    rd->ctx = NULL;
+    rd->packet = NULL;
+    rd->frame = NULL;
+    atomic_init(&rd->job, JOB_IDLE);
+    pool_task_init(&rd->task, &encode_pool, rendition_step, NULL, rd);
+  }
+  x->num_renditions = 0;
+  pthread_mutex_init(&x->rendition_mutex, NULL);
+  pthread_cond_init(&x->rendition_done, NULL);
+  x->frame = NULL;
+  for (int i = 0; i < RTMP_FRAME_POOL; i++)
+    x->frames[i] = NULL;
+  x->frame_index = 0;
+  x->packets.free = NULL;
+  x->packets.count = 0;
+  x->packets.capacity = 0;
+  pthread_mutex_init(&x->packets.mutex, NULL);
+  x->packet_buffers = NULL;
+  x->packet_buffer_size = 0;
+  atomic_init(&x->pool_misses, 0);
+  x->frame_capacity = 0;
+  x->frame_fill = 0;
+  x->convert = NULL;
+  x->staging = NULL;
+  x->staging_size = 0;
+  x->pts = 0;
+  atomic_init(&x->streaming_active, 0); // Initialize streaming as inactive
+  atomic_init(&x->monitor, MONITOR_INPUT);
+  atomic_init(&x->monitor_prebuffer, 0);
+  x->monitor_dec = NULL;
+  x->monitor_swr = NULL;
+  x->monitor_frame = NULL;
+  x->monitor_buf = NULL;
+  x->monitor_failed = 0;
+
+  message_queue_init(&x->commands);
+  message_queue_init(&x->replies);
+  pool_task_init(&x->task, &encode_pool, streaming_worker_step,
+                 streaming_worker_finished, x);
+  x->worker_phase = WORKER_SETUP;
+  atomic_init(&x->writers_running, 0);
+  atomic_init(&x->stop_requested, 0);
+  x->worker_quit = 0;
+  atomic_init(&x->worker_exited, 0);
+  preroll_buffer_init(&x->preroll, channels, 0);
+  atomic_init(&x->reconnect, 1);
+  x->archive_segment = RTMP_DEFAULT_SEGMENT_SECONDS;
+  x->policy = QUEUE_DROP_OLDEST;
+  x->pause = PAUSE_OFF;
+  atomic_init(&x->abort_deadline, 0);
 
-// Include FFmpeg headers
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavutil/avassert.h>
-#include <libavutil/channel_layout.h>
-#include <libavutil/opt.h>
-#include <libavutil/samplefmt.h>
+  atomic_init(&x->dropped_samples, 0);
+  atomic_init(&x->encode_errors, 0);
+  atomic_init(&x->write_errors, 0);
+  atomic_init(&x->reconnects, 0);
+  atomic_init(&x->bytes_written, 0);
+  atomic_init(&x->packets_written, 0);
+  latency_stat_init(&x->encode_latency);
+  latency_stat_init(&x->write_latency);
 
-// Define the class pointer
-static t_class *rtmpstreamer_tilde_class;
+  t_float sr = sys_getsr();
+  if (sr < 48000)
+    sr = 48000;
+  if (ring_buffer_init(&x->ring, channels, (size_t)(sr * RTMP_RING_SECONDS)) <
+          0 ||
+      ring_buffer_init(&x->monitor_ring, 1,
+                       (size_t)(sr * RTMP_MONITOR_SECONDS)) < 0) {
+    streamer_release(x);
+    return NULL;
+  }
+  return x;
+}
 
-// Define the object structure
-typedef struct _rtmpstreamer_tilde {
-  t_object x_obj;            // The object itself
-  t_symbol *url;             // RTMP URL
-  AVFormatContext *fmt_ctx;  // Format context
-  AVStream *audio_st;        // Audio stream
-  AVCodecContext *codec_ctx; // Codec context
-  AVFrame *frame;            // Audio frame
-  int64_t pts;               // Presentation timestamp
-  t_sample f;                // Signal inlet placeholder
-  int streaming_active;      // Flag to indicate if streaming is active
-} t_rtmpstreamer_tilde;
+static void set_outputs(t_rtmpstreamer_tilde *x);
 
-// Function prototypes
-void rtmpstreamer_tilde_symbol(t_rtmpstreamer_tilde *x, t_symbol *s);
-void rtmpstreamer_tilde_dsp(t_rtmpstreamer_tilde *x, t_signal **sp);
-t_int *rtmpstreamer_tilde_perform(t_int *w);
-void *rtmpstreamer_tilde_new(t_symbol *s);
-void rtmpstreamer_tilde_free(t_rtmpstreamer_tilde *x);
-void rtmpstreamer_tilde_setup(void);
+// Start a session with the object's settings. The encoder task connects to
+// every output in the background. If the last session is still stopping,
+// the new one starts once it has finished.
+int start_streaming_worker(t_rtmpstreamer_tilde *x) {
+  t_streamer *st = x->st;
+  if (x->stopping) {
+    x->restart = 1;
+    return 0;
+  }
+  if (x->worker_running || x->num_urls + (x->archive_path ? 1 : 0) == 0)
+    return 0;
 
-// Helper function prototypes
-int initialize_streaming(t_rtmpstreamer_tilde *x);
-void cleanup_streaming(t_rtmpstreamer_tilde *x);
+  if (worker_pool_start() < 0) {
+    pd_error(x, "[rtmpstreamer~] Could not start streaming worker");
+    return -1;
+  }
+  if (preroll_buffer_init(&st->preroll, x->channels,
+                          (size_t)(sys_getsr() * x->preroll_seconds)) < 0) {
+    pd_error(x, "[rtmpstreamer~] Could not allocate pre-roll buffer");
+    return -1;
+  }
 
-// DSP method
-void rtmpstreamer_tilde_dsp(t_rtmpstreamer_tilde *x, t_signal **sp) {
-  // Add perform method to DSP chain
-  dsp_add(rtmpstreamer_tilde_perform, 3, x, sp[0]->s_vec, sp[0]->s_n);
+  // No task of the last session is left, so the streamer is the Pd
+  // thread's until the encoder task starts
+  if (x->outputs_changed)
+    set_outputs(x);
+  st->codec = x->codec;
+  st->bit_rate = x->bit_rate;
+  st->low_latency = x->low_latency;
+  st->abr = x->abr;
+  for (int i = 0; i < x->ladder_size; i++)
+    st->ladder[i] = x->ladder[i];
+  st->ladder_size = x->ladder_size;
+  st->out_rate = x->out_rate;
+  st->archive_segment = x->archive_segment;
+  // Pd's globals are not for the pool threads: the rate the ring is filled
+  // at is taken here, and the DSP method hands on any change
+  st->start_rate = x->dsp_rate > 0 ? x->dsp_rate : (int)sys_getsr();
+
+  ring_buffer_reset(&st->ring);
+  st->frame_fill = 0;
+  st->pts = 0; // Every session starts its timeline at zero
+  atomic_store(&st->pending_rate, 0);
+  // Commands left from the last session do not apply to this one
+  t_message stale;
+  while (message_queue_pop(&st->commands, &stale) == 0)
+    ;
+  atomic_store(&st->stop_requested, 0);
+  st->worker_quit = 0;
+  st->policy = x->queue_policy;
+  st->pause = x->paused;
+  st->worker_phase = WORKER_SETUP;
+  atomic_store(&st->worker_exited, 0);
+  atomic_store(&st->abort_deadline, 0);
+  for (int i = 0; i < st->num_outputs; i++)
+    atomic_store(&st->outputs[i].state, STREAM_CONNECTING);
+  st->session++;
+
+  // The session holds the streamer and the pools until its tasks are done
+  atomic_fetch_add(&st->refs, 1);
+  worker_pool_retain();
+  // From here on audio is queued, and kept in the pre-roll until connected
+  atomic_store_explicit(&st->streaming_active, 1, memory_order_release);
+  pool_task_start(&st->task);
+  x->worker_running = 1;
+  clock_delay(x->clock, RTMP_TICK_MS);
+  return 0;
 }
 
-// Perform function
-t_int *rtmpstreamer_tilde_perform(t_int *w) {
-  t_rtmpstreamer_tilde *x = (t_rtmpstreamer_tilde *)(w[1]);
-  t_sample *in = (t_sample *)(w[2]);
-  int n = (int)(w[3]);
+// Tell the session to stop and return: the encoder task sends the tail of
+// the stream and the writers close their connections in the background.
+// Pending connection attempts are interrupted right away. The session
+// reports back through the reply queue once it has finished.
+void stop_streaming_worker(t_rtmpstreamer_tilde *x) {
+  t_streamer *st = x->st;
+  x->restart = 0;
+  if (!x->worker_running || x->stopping)
+    return;
+
+  int64_t timeout =
+      any_output_streaming(st) ? RTMP_STOP_TIMEOUT_MS * 1000LL : 0;
+  atomic_store(&st->abort_deadline, av_gettime_relative() + timeout);
+
+  // A queue full of other commands must not lose the stop
+  t_message cmd = {CMD_STOP, -1, 0, ""};
+  if (message_queue_push(&st->commands, &cmd) < 0)
+    atomic_store(&st->stop_requested, 1);
+  pool_task_wake(&st->task);
+  x->stopping = 1;
+}
+
+// The session has finished and no task touches the streamer any more
+static void streaming_stopped(t_rtmpstreamer_tilde *x) {
+  t_streamer *st = x->st;
+  if (x->stopping) {
+    for (int i = 0; i < st->num_outputs; i++)
+      atomic_store(&st->outputs[i].state, STREAM_IDLE);
+    if (!x->restart)
+      post("[rtmpstreamer~] Stopped");
+  }
+  preroll_buffer_free(&st->preroll);
+  x->worker_running = 0;
+  x->stopping = 0;
+}
 
-  // If streaming is active, process and send frames
-  if (x->streaming_active) {
-    int ret;
+// Clock callback: report worker state and errors on the Pd thread
+void rtmpstreamer_tilde_tick(t_rtmpstreamer_tilde *x) {
+  t_streamer *st = x->st;
+  unsigned dropped = atomic_load(&st->dropped_samples);
+  unsigned encode_errors = atomic_load(&st->encode_errors);
+  unsigned write_errors = atomic_load(&st->write_errors);
 
-    // Prepare frame
-    // For AAC, use floating point planar format
-    float *samples = (float *)x->frame->data[0];
+  if (dropped != x->reported_dropped) {
+    pd_error(x, "[rtmpstreamer~] Streaming worker fell behind, dropped %u "
+                "samples",
+             dropped - x->reported_dropped);
+    x->reported_dropped = dropped;
+  }
+  if (encode_errors != x->reported_encode_errors) {
+    pd_error(x, "[rtmpstreamer~] Error encoding audio frame (%u times)",
+             encode_errors - x->reported_encode_errors);
+    x->reported_encode_errors = encode_errors;
+  }
+  if (write_errors != x->reported_write_errors) {
+    pd_error(x, "[rtmpstreamer~] Error while writing audio frame (%u times)",
+             write_errors - x->reported_write_errors);
+    x->reported_write_errors = write_errors;
+  }
 
-    for (int i = 0; i < n; i++) {
-      float sample = in[i];
-      // Clamp the sample to [-1.0, 1.0]
-      if (sample < -1.0f)
-        sample = -1.0f;
-      if (sample > 1.0f)
-        sample = 1.0f;
-      samples[i] = sample;
+  // Replies from the worker tasks, in the order they were sent
+  t_message reply;
+  int stopped = 0;
+  while (message_queue_pop(&st->replies, &reply) == 0) {
+    if (reply.type == REPLY_ERROR) {
+      pd_error(x, "%s", reply.text);
+    } else if (reply.type == REPLY_BITRATE && reply.output >= 0 &&
+               reply.output < st->num_outputs) {
+      // "bitrate <kbps> <url>" whenever adaptive bitrate switches rungs
+      t_rtmp_output *out = &st->outputs[reply.output];
+      if (out->reported_bit_rate > 0 && reply.value != out->reported_bit_rate)
+        post("[rtmpstreamer~] Output '%s' %s to %d kbps", out->url->s_name,
+             reply.value < out->reported_bit_rate ? "down" : "up",
+             reply.value / 1000);
+      t_atom args[2];
+      SETFLOAT(&args[0], reply.value / 1000);
+      SETSYMBOL(&args[1], out->url);
+      outlet_anything(x->state_out, gensym("bitrate"), 2, args);
+      out->reported_bit_rate = reply.value;
+    } else if (reply.type == REPLY_STOPPED && reply.value == st->session) {
+      stopped = 1;
     }
+  }
+  unsigned lost = atomic_load(&st->replies.lost);
+  if (lost != x->reported_lost_replies) {
+    pd_error(x, "[rtmpstreamer~] %u worker messages lost",
+             lost - x->reported_lost_replies);
+    x->reported_lost_replies = lost;
+  }
+  // The flag stands in for a stop reply lost to a full queue
+  if (x->worker_running && (stopped || atomic_load(&st->worker_exited)))
+    streaming_stopped(x);
 
-    x->frame->nb_samples = n;
-    x->frame->pts = x->pts;
-    x->pts += x->frame->nb_samples;
+  // Estimated pipeline latency, once per session setup
+  int latency_us = atomic_load(&st->pipeline_latency_us);
+  if (latency_us != x->reported_latency_us && latency_us > 0) {
+    t_atom arg;
+    post("[rtmpstreamer~] Pipeline latency %.1f ms (%s mode)",
+         latency_us / 1000.0, st->low_latency ? "low" : "normal");
+    SETFLOAT(&arg, latency_us / 1000.0f);
+    outlet_anything(x->state_out, gensym("latency"), 1, &arg);
+    x->reported_latency_us = latency_us;
+  }
 
-    // Send the frame to the encoder
-    ret = avcodec_send_frame(x->codec_ctx, x->frame);
-    if (ret < 0) {
-      pd_error(x, "[rtmpstreamer~] Error sending frame to codec");
-      return (w + 4);
+  // One "state <name> <url>" message per output that changed
+  for (int i = 0; i < st->num_outputs; i++) {
+    t_rtmp_output *out = &st->outputs[i];
+    unsigned dropped_packets = atomic_load(&out->dropped_packets);
+    if (dropped_packets != out->reported_dropped_packets) {
+      pd_error(x, "[rtmpstreamer~] Output '%s' fell behind, dropped %u "
+                  "packets",
+               out->url->s_name, dropped_packets - out->reported_dropped_packets);
+      out->reported_dropped_packets = dropped_packets;
     }
 
-    AVPacket pkt = {0}; // Initialize the packet
+    t_stream_state state = (t_stream_state)atomic_load(&out->state);
+    if (state == out->reported_state)
+      continue;
 
-    // Receive packets from the encoder
-    while (ret >= 0) {
-      ret = avcodec_receive_packet(x->codec_ctx, &pkt);
-      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-        break;
-      else if (ret < 0) {
-        pd_error(x, "[rtmpstreamer~] Error encoding audio frame");
-        break;
-      }
+    const char *url = out->url->s_name;
+    if (state == STREAM_STREAMING && out->archive)
+      post("[rtmpstreamer~] Recording to %s", url);
+    else if (state == STREAM_STREAMING)
+      post("[rtmpstreamer~] Successfully streaming to %s", url);
+    else if (state == STREAM_RECONNECTING)
+      pd_error(x, "[rtmpstreamer~] Connection to '%s' failed, reconnecting",
+               url);
+    else if (state == STREAM_ERROR)
+      pd_error(x, "[rtmpstreamer~] Failed to initialize streaming to '%s'",
+               url);
 
-      // Set the stream index
-      pkt.stream_index = x->audio_st->index;
+    t_atom args[2];
+    SETSYMBOL(&args[0], gensym(stream_state_names[state]));
+    SETSYMBOL(&args[1], out->url);
+    outlet_anything(x->state_out, gensym("state"), 2, args);
+    out->reported_state = state;
+  }
 
-      // Write the compressed frame to the media file
-      ret = av_interleaved_write_frame(x->fmt_ctx, &pkt);
-      av_packet_unref(&pkt);
-      if (ret < 0) {
-        pd_error(x, "[rtmpstreamer~] Error while writing audio frame");
-        break;
-      }
-    }
+  // A start that waited for the last session, with the outputs of that
+  // one reported first
+  if (x->restart && !x->worker_running) {
+    x->restart = 0;
+    start_streaming_worker(x);
   }
 
-  // If streaming is inactive, optionally pass the audio through or do nothing
-  // For this example, we'll do nothing to minimize CPU usage
+  // Keep polling while the session may still change state
+  if (x->worker_running)
+    clock_delay(x->clock, RTMP_TICK_MS);
+}
 
-  return (w + 4);
+// Accept URLs with a known scheme (see transports), file: URLs and paths.
+// A path needs a directory or an extension, so stray words are not taken
+// for file names.
+int is_valid_stream_url(const char *url) {
+  if (find_transport(url) || !strncmp(url, "file:", 5))
+    return 1;
+  return !strstr(url, "://") && (strchr(url, '/') || strchr(url, '.'));
 }
 
-int is_valid_rtmp_url(const char* url) {
-    // Simple check to verify that the URL starts with "rtmp://"
-    return (strncmp(url, "rtmp://", 7) == 0);
+// Give the streamer one output per URL set last, plus the archive if one is
+// set. No session may be running.
+static void set_outputs(t_rtmpstreamer_tilde *x) {
+  t_streamer *st = x->st;
+  free_outputs(st);
+  x->outputs_changed = 0;
+  int total = x->num_urls + (x->archive_path ? 1 : 0);
+  if (total <= 0)
+    return;
+
+  st->outputs = (t_rtmp_output *)getbytes(total * sizeof(t_rtmp_output));
+  st->num_outputs = total;
+  for (int i = 0; i < total; i++) {
+    t_rtmp_output *out = &st->outputs[i];
+    out->owner = st;
+    out->archive = i == x->num_urls;
+    out->url = out->archive ? x->archive_path : x->urls[i];
+    out->fmt_ctx = NULL;
+    out->audio_st = NULL;
+    out->header_written = 0;
+    out->session_failed = 0;
+    out->queue_head = 0;
+    out->queue_count = 0;
+    out->quit = 0;
+    pthread_mutex_init(&out->mutex, NULL);
+    atomic_init(&out->dropped_packets, 0);
+    atomic_init(&out->queue_fill, 0);
+    atomic_init(&out->io_deadline, 0);
+    out->reported_dropped_packets = 0;
+    pool_task_init(&out->task, &io_pool, output_writer_step,
+                   output_writer_finished, out);
+    out->connected = 0;
+    out->reconnecting = 0;
+    out->backoff_ms = RTMP_RECONNECT_MIN_MS;
+    atomic_init(&out->state, STREAM_IDLE);
+    out->reported_state = STREAM_IDLE;
+    out->rendition = 0;
+    for (int r = 0; r < RTMP_MAX_RENDITIONS; r++)
+      out->extra_stream[r] = 0;
+    out->num_streams = 1;
+    out->rung = 0;
+    out->next_pts = AV_NOPTS_VALUE;
+    latency_stat_init(&out->abr_latency);
+    out->abr_dropped = 0;
+    out->abr_calm = 0;
+    out->reported_bit_rate = 0;
+  }
 }
 
 // Constructor
-void *rtmpstreamer_tilde_new(t_symbol *s) {
+//
+// Creation arguments, in any order: one or more URLs (symbols), a codec
+// name (aac, opus, mp3, flac or pcm; default aac) and the number of
+// channels (float, default 1). One signal inlet is created per channel.
+void *rtmpstreamer_tilde_new(t_symbol *sel, int argc, t_atom *argv) {
   t_rtmpstreamer_tilde *x =
       (t_rtmpstreamer_tilde *)pd_new(rtmpstreamer_tilde_class);
+  x->channels = 1;
+  x->codec = &codec_descs[0];
+  x->num_urls = 0;
+  for (int i = 0; i < argc; i++) {
+    if (argv[i].a_type == A_FLOAT) {
+      x->channels = (int)atom_getfloat(argv + i);
+    } else if (argv[i].a_type == A_SYMBOL) {
+      t_symbol *s = atom_getsymbol(argv + i);
+      const t_codec_desc *codec = find_codec_desc(s->s_name);
+      if (codec) {
+        x->codec = codec;
+        continue;
+      }
+      // Do not start streaming at object creation if no valid URL
+      if (is_valid_stream_url(s->s_name) && x->num_urls < RTMP_MAX_OUTPUTS)
+        x->urls[x->num_urls++] = s;
+      else
+        post("[rtmpstreamer~] Ignoring invalid URL at creation: %s",
+             s->s_name);
+    }
+  }
+  if (x->channels < 1 || x->channels > RTMP_MAX_CHANNELS) {
+    pd_error(x, "[rtmpstreamer~] Channel count must be 1 to %d, using %d",
+             RTMP_MAX_CHANNELS, x->channels < 1 ? 1 : RTMP_MAX_CHANNELS);
+    x->channels = x->channels < 1 ? 1 : RTMP_MAX_CHANNELS;
+  }
 
-  x->url = NULL;
-  x->fmt_ctx = NULL;
-  x->codec_ctx = NULL;
-  x->audio_st = NULL;
-  x->frame = NULL;
-  x->pts = 0;
-  x->streaming_active = 0; // Initialize streaming as inactive
+  x->bit_rate = 0;
+  x->low_latency = 0;
+  x->abr = 0;
+  x->ladder_size = 0;
+  x->out_rate = 0;
+  x->preroll_seconds = RTMP_DEFAULT_PREROLL_SECONDS;
+  x->archive_path = NULL;
+  x->archive_segment = RTMP_DEFAULT_SEGMENT_SECONDS;
+  x->queue_policy = QUEUE_DROP_OLDEST;
+  x->paused = PAUSE_OFF;
+  x->outputs_changed = 1;
+  x->worker_running = 0;
+  x->stopping = 0;
+  x->restart = 0;
+  x->dsp_rate = 0;
+  x->monitor_primed = 0;
+  x->reported_latency_us = 0;
+  x->reported_dropped = 0;
+  x->reported_encode_errors = 0;
+  x->reported_write_errors = 0;
+  x->reported_lost_replies = 0;
+  x->stats_bytes = 0;
+  x->stats_time = clock_getlogicaltime();
+  x->stats_interval = 0;
+  x->stats_clock = clock_new(x, (t_method)rtmpstreamer_tilde_stats_tick);
+  x->clock = clock_new(x, (t_method)rtmpstreamer_tilde_tick);
+  worker_pool_retain();
+  network_retain();
+
+  // Everything the destructor releases is set up by now, so a failure here
+  // goes through it like any other object
+  x->st = streamer_new(x->channels);
+  if (!x->st) {
+    pd_error(x, "[rtmpstreamer~] Could not allocate ring buffer");
+    pd_free((t_pd *)x);
+    return NULL;
+  }
 
-  // Create inlets and outlets
+  // Create inlets and outlets: one signal inlet per channel (the first is
+  // the main signal inlet), then the URL inlet
+  for (int ch = 1; ch < x->channels; ch++)
+    inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_signal, &s_signal);
   inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_symbol,
             gensym("symbol"));      // For setting URL
   outlet_new(&x->x_obj, &s_signal); // Signal outlet
+  x->state_out = outlet_new(&x->x_obj, 0); // State messages
 
-  // Do not start streaming at object creation if no valid URL
-  if (s && strlen(s->s_name) > 0 && is_valid_rtmp_url(s->s_name)) {
-    x->url = s;
-    post("[rtmpstreamer~] Valid URL provided at creation: %s", x->url->s_name);
+  if (x->num_urls > 0) {
+    for (int i = 0; i < x->num_urls; i++)
+      post("[rtmpstreamer~] Valid URL provided at creation: %s",
+           x->urls[i]->s_name);
   } else {
     post("[rtmpstreamer~] Invalid or no URL provided at creation. "
          "Non-streaming mode.");
@@ -162,154 +3504,767 @@ void *rtmpstreamer_tilde_new(t_symbol *s) {
 }
 
 // Symbol handling (URL change)
+//
+// Only asks the current session to stop and hands the new URL to the next
+// one; both happen in the background.
 void rtmpstreamer_tilde_symbol(t_rtmpstreamer_tilde *x, t_symbol *s) {
-  // If streaming is active, clean up before switching URL
-  if (x->streaming_active) {
-    cleanup_streaming(x);
-    x->streaming_active = 0;
+  t_atom arg;
+  SETSYMBOL(&arg, s);
+  rtmpstreamer_tilde_url(x, gensym("url"), 1, &arg);
+}
+
+// "url <url> ..." sets one or more destinations. The audio is encoded once
+// and sent to all of them; with no arguments streaming stops.
+void rtmpstreamer_tilde_url(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                            t_atom *argv) {
+  // Stop the current session (or a failed one) before switching URLs
+  stop_streaming_worker(x);
+
+  if (argc > RTMP_MAX_OUTPUTS) {
+    pd_error(x, "[rtmpstreamer~] At most %d URLs, ignoring the rest",
+             RTMP_MAX_OUTPUTS);
+    argc = RTMP_MAX_OUTPUTS;
+  }
+  x->num_urls = 0;
+  for (int i = 0; i < argc; i++) {
+    t_symbol *url = atom_getsymbol(argv + i);
+    if (is_valid_stream_url(url->s_name))
+      x->urls[x->num_urls++] = url;
+    else if (strlen(url->s_name) > 0)
+      pd_error(x, "[rtmpstreamer~] Ignoring invalid URL: %s", url->s_name);
+  }
+  // The next session gets the new outputs
+  x->outputs_changed = 1;
+
+  if (x->num_urls > 0) {
+    for (int i = 0; i < x->num_urls; i++)
+      post("[rtmpstreamer~] Attempting to stream to %s",
+           x->urls[i]->s_name);
+    start_streaming_worker(x);
+  } else if (x->archive_path) {
+    // Without URLs the archive is the only output, like "start" does
+    post("[rtmpstreamer~] No URL, recording to the archive only");
+    start_streaming_worker(x);
+  } else {
+    x->paused = PAUSE_OFF;
+    post("[rtmpstreamer~] Invalid or empty URL. Non-streaming mode.");
   }
+}
 
-  // Set the new URL and attempt streaming initialization
-  x->url = s;
+// "start" connects to the URLs set last and streams; "stop" sends the tail
+// of the stream and disconnects, but keeps the URLs for the next "start"
+void rtmpstreamer_tilde_start(t_rtmpstreamer_tilde *x) {
+  if ((x->worker_running && !x->stopping) || x->restart)
+    return;
+  if (x->num_urls == 0 && !x->archive_path) {
+    pd_error(x, "[rtmpstreamer~] start: no URL set");
+    return;
+  }
+  for (int i = 0; i < x->num_urls; i++)
+    post("[rtmpstreamer~] Attempting to stream to %s", x->urls[i]->s_name);
+  start_streaming_worker(x);
+}
 
-  if (x->url && strlen(x->url->s_name) > 0) {
-    post("[rtmpstreamer~] Attempting to stream to %s", x->url->s_name);
-    if (initialize_streaming(x) == 0) {
-      x->streaming_active = 1;
-      post("[rtmpstreamer~] Successfully streaming to %s", x->url->s_name);
-    } else {
-      pd_error(x, "[rtmpstreamer~] Failed to initialize streaming to '%s'",
-               x->url->s_name);
+// Returns right away; "Stopped" is posted once the session has finished
+void rtmpstreamer_tilde_stop(t_rtmpstreamer_tilde *x) {
+  x->paused = PAUSE_OFF;
+  stop_streaming_worker(x);
+}
+
+// Tell the encoder task to pause or resume, and report it as "paused 0|1".
+// A session whose setup failed has exited before the clock noticed, and
+// would never read the command.
+static void set_pause(t_rtmpstreamer_tilde *x, t_pause_mode mode) {
+  if (!x->worker_running || x->stopping ||
+      atomic_load(&x->st->worker_exited)) {
+    pd_error(x, "[rtmpstreamer~] %s: not streaming",
+             mode == PAUSE_OFF ? "resume" : "pause");
+    return;
+  }
+  if (mode == x->paused)
+    return;
+  t_message cmd = {CMD_PAUSE, -1, mode, ""};
+  if (message_queue_push(&x->st->commands, &cmd) < 0) {
+    pd_error(x, "[rtmpstreamer~] Worker busy, try again");
+    return;
+  }
+  pool_task_wake(&x->st->task);
+  x->paused = mode;
+
+  t_atom arg;
+  if (mode == PAUSE_OFF)
+    post("[rtmpstreamer~] Resumed");
+  else
+    post("[rtmpstreamer~] Paused (%s)", pause_mode_names[mode]);
+  SETFLOAT(&arg, mode != PAUSE_OFF);
+  outlet_anything(x->state_out, gensym("paused"), 1, &arg);
+}
+
+// "pause" keeps the connections open but stops sending the input: "pause
+// silence" (default) sends silent frames, which keeps servers that drop
+// idle publishers happy, "pause nothing" sends no packets at all. "resume"
+// continues at the next timestamp, without a new handshake. The pause
+// lasts over restarts by other settings, until "resume" or "stop".
+void rtmpstreamer_tilde_pause(t_rtmpstreamer_tilde *x, t_symbol *s) {
+  t_pause_mode mode = PAUSE_SILENCE;
+  if (*s->s_name) {
+    if (!strcmp(s->s_name, pause_mode_names[PAUSE_SILENCE]))
+      mode = PAUSE_SILENCE;
+    else if (!strcmp(s->s_name, pause_mode_names[PAUSE_NOTHING]))
+      mode = PAUSE_NOTHING;
+    else {
+      pd_error(x, "[rtmpstreamer~] pause: expected silence or nothing, got "
+                  "'%s'",
+               s->s_name);
+      return;
+    }
+  }
+  set_pause(x, mode);
+}
+
+void rtmpstreamer_tilde_resume(t_rtmpstreamer_tilde *x) {
+  set_pause(x, PAUSE_OFF);
+}
+
+// Enable or disable automatic reconnection
+void rtmpstreamer_tilde_reconnect(t_rtmpstreamer_tilde *x, t_floatarg f) {
+  atomic_store(&x->st->reconnect, f != 0);
+}
+
+// Set how many seconds of audio are kept while reconnecting
+void rtmpstreamer_tilde_preroll(t_rtmpstreamer_tilde *x, t_floatarg f) {
+  if (f < 0)
+    f = 0;
+  x->preroll_seconds = f;
+  if (x->worker_running)
+    post("[rtmpstreamer~] preroll: %g seconds from the next URL", f);
+}
+
+// Choose what happens when an output cannot keep up: "overflow drop-oldest"
+// (default), "overflow drop-newest" or "overflow block". Blocking stalls the
+// encoder instead, so audio then backs up in the ring buffer.
+void rtmpstreamer_tilde_overflow(t_rtmpstreamer_tilde *x, t_symbol *s) {
+  for (int i = 0; i <= QUEUE_BLOCK; i++) {
+    if (!strcmp(s->s_name, queue_policy_names[i])) {
+      x->queue_policy = (t_queue_policy)i;
+      if (x->worker_running && !x->stopping) {
+        t_message cmd = {CMD_OVERFLOW, -1, i, ""};
+        if (message_queue_push(&x->st->commands, &cmd) < 0)
+          pd_error(x, "[rtmpstreamer~] overflow: worker busy, applies from "
+                      "the next session");
+        else
+          pool_task_wake(&x->st->task);
+      }
+      return;
+    }
+  }
+  pd_error(x, "[rtmpstreamer~] overflow: unknown policy '%s' (drop-oldest, "
+              "drop-newest or block)",
+           s->s_name);
+}
+
+// Send one "stats <name> <value>" message
+static void stats_out(t_rtmpstreamer_tilde *x, const char *name, t_float f) {
+  t_atom args[2];
+  SETSYMBOL(&args[0], gensym(name));
+  SETFLOAT(&args[1], f);
+  outlet_anything(x->state_out, gensym("stats"), 2, args);
+}
+
+// Report the statistics on the right outlet. Rates, means and maxima cover
+// the time since the previous report; counts are totals. Only atomics are
+// read, so this never waits for the worker or the writers.
+static void rtmpstreamer_tilde_report_stats(t_rtmpstreamer_tilde *x) {
+  t_streamer *st = x->st;
+  unsigned long long bytes = atomic_load(&st->bytes_written);
+  double elapsed = clock_gettimesince(x->stats_time) / 1000.0;
+  t_float rate = elapsed > 0 ? (t_float)((bytes - x->stats_bytes) / elapsed) : 0;
+  x->stats_bytes = bytes;
+  x->stats_time = clock_getlogicaltime();
+
+  int queue_fill = 0;
+  unsigned dropped_packets = 0;
+  for (int i = 0; i < st->num_outputs; i++) {
+    int fill = atomic_load(&st->outputs[i].queue_fill);
+    if (fill > queue_fill)
+      queue_fill = fill;
+    dropped_packets += atomic_load(&st->outputs[i].dropped_packets);
+  }
+
+  t_float encode_mean, encode_max, write_mean, write_max;
+  latency_stat_take(&st->encode_latency, &encode_mean, &encode_max);
+  latency_stat_take(&st->write_latency, &write_mean, &write_max);
+
+  stats_out(x, "bytes_per_sec", rate);
+  stats_out(x, "packets", (t_float)atomic_load(&st->packets_written));
+  stats_out(x, "queue", (t_float)queue_fill);
+  stats_out(x, "queue_size", RTMP_OUTPUT_QUEUE_PACKETS);
+  stats_out(x, "dropped_samples", (t_float)atomic_load(&st->dropped_samples));
+  stats_out(x, "dropped_packets", (t_float)dropped_packets);
+  stats_out(x, "reconnects", (t_float)atomic_load(&st->reconnects));
+  stats_out(x, "pool_misses", (t_float)atomic_load(&st->pool_misses));
+  stats_out(x, "encode_ms", encode_mean);
+  stats_out(x, "encode_max_ms", encode_max);
+  stats_out(x, "write_ms", write_mean);
+  stats_out(x, "write_max_ms", write_max);
+  // The pipeline estimate plus the time the deepest queue holds
+  stats_out(x, "latency_ms",
+            (atomic_load(&st->pipeline_latency_us) +
+             (t_float)queue_fill * atomic_load(&st->frame_us)) /
+                1000.0f);
+}
+
+// "stats" reports once; "stats <ms>" also reports every ms milliseconds,
+// "stats 0" stops the periodic reports
+void rtmpstreamer_tilde_stats(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                              t_atom *argv) {
+  if (argc > 0) {
+    t_float interval = atom_getfloat(argv);
+    x->stats_interval = interval > 0 ? interval : 0;
+    if (x->stats_interval > 0)
+      clock_delay(x->stats_clock, x->stats_interval);
+    else
+      clock_unset(x->stats_clock);
+  }
+  rtmpstreamer_tilde_report_stats(x);
+}
+
+// Clock callback for periodic statistics
+void rtmpstreamer_tilde_stats_tick(t_rtmpstreamer_tilde *x) {
+  rtmpstreamer_tilde_report_stats(x);
+  if (x->stats_interval > 0)
+    clock_delay(x->stats_clock, x->stats_interval);
+}
+
+// The worker tasks read their own copy of the settings, taken when a
+// session starts, so the handlers below change the object's settings while
+// a session runs and then call this. It sends the session a stop command
+// and returns; the clock starts the next session with the new settings once
+// the stop reply arrives. Settings that apply live go to the encoder task as
+// commands instead.
+static void restart_streaming_worker(t_rtmpstreamer_tilde *x) {
+  if ((!x->worker_running || x->stopping) && !x->restart)
+    return;
+  stop_streaming_worker(x);
+  start_streaming_worker(x);
+}
+
+// "codec <name> [kbps]" selects the encoder for the next session and
+// restarts a running one. Without a bitrate the codec's default is used;
+// lossless codecs ignore it.
+void rtmpstreamer_tilde_codec(t_rtmpstreamer_tilde *x, t_symbol *s,
+                              t_floatarg kbps) {
+  const t_codec_desc *codec = find_codec_desc(s->s_name);
+  if (!codec) {
+    pd_error(x, "[rtmpstreamer~] codec: unknown codec '%s' (aac, opus, mp3, "
+                "flac or pcm)",
+             s->s_name);
+    return;
+  }
+  x->codec = codec;
+  x->bit_rate = kbps > 0 ? (int)(kbps * 1000) : 0;
+  restart_streaming_worker(x);
+}
+
+// "latency low" minimizes buffering: low-delay codec settings (AAC-LD with
+// libfdk_aac, 5 ms Opus frames), no muxer interleaving and a flush per
+// packet. "latency normal" restores the defaults. A running stream is
+// restarted; the resulting pipeline latency is reported once it is up.
+void rtmpstreamer_tilde_latency(t_rtmpstreamer_tilde *x, t_symbol *s) {
+  int low = !strcmp(s->s_name, "low");
+  if (!low && strcmp(s->s_name, "normal")) {
+    pd_error(x, "[rtmpstreamer~] latency: expected low or normal, got '%s'",
+             s->s_name);
+    return;
+  }
+
+  x->low_latency = low;
+  restart_streaming_worker(x);
+}
+
+// "samplerate <hz>" sets the stream's sample rate, independent of Pd's;
+// 0 follows Pd. Rates the encoder does not support are rounded to the
+// nearest one it does. A running stream is restarted.
+void rtmpstreamer_tilde_samplerate(t_rtmpstreamer_tilde *x, t_floatarg f) {
+  x->out_rate = f > 0 ? (int)f : 0;
+  restart_streaming_worker(x);
+}
+
+// "abr 1" turns on adaptive bitrate: encoders at half and a quarter of the
+// bitrate (down to the codec's minimum) run alongside the main one, and each
+// network output moves between them as its connection slows down or
+// recovers. Costs an encoder per rung; lossless codecs have no rungs. With
+// a ladder, outputs step between its renditions instead, never above their
+// own. "abr 0" turns it off. A running stream is restarted.
+void rtmpstreamer_tilde_abr(t_rtmpstreamer_tilde *x, t_floatarg f) {
+  x->abr = f != 0;
+  restart_streaming_worker(x);
+}
+
+// "ladder <kbps> ..." encodes the input at up to four bitrates at once, for
+// CDNs that take several renditions; the first one is the main stream (the
+// archive and the stream monitor). The i-th URL gets the i-th rendition;
+// with fewer URLs, the last one carries the rest as extra audio streams,
+// which needs MPEG-TS or Matroska. The encoders share conversion and
+// resampling and run in parallel on the encode pool. "ladder off" or
+// "ladder" goes back to one rendition. A running stream is restarted.
+void rtmpstreamer_tilde_ladder(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                               t_atom *argv) {
+  int ladder[RTMP_MAX_RENDITIONS];
+  int size = 0;
+  if (argc > 0 && argv[0].a_type == A_SYMBOL &&
+      !strcmp(atom_getsymbol(argv)->s_name, "off"))
+    argc = 0;
+  if (argc > RTMP_MAX_RENDITIONS) {
+    pd_error(x, "[rtmpstreamer~] ladder: at most %d renditions, ignoring the "
+                "rest",
+             RTMP_MAX_RENDITIONS);
+    argc = RTMP_MAX_RENDITIONS;
+  }
+  for (int i = 0; i < argc; i++) {
+    t_float kbps = atom_getfloat(argv + i);
+    if (argv[i].a_type != A_FLOAT || kbps <= 0) {
+      pd_error(x, "[rtmpstreamer~] ladder: expected bitrates in kbps");
+      return;
+    }
+    ladder[size++] = (int)(kbps * 1000);
+  }
+  for (int i = 0; i < size; i++)
+    x->ladder[i] = ladder[i];
+  x->ladder_size = size;
+  restart_streaming_worker(x);
+}
+
+// "monitor input|stream|off" picks what the signal outlet plays: the input
+// mixed to mono (default), the encoded stream decoded again, delayed by the
+// pipeline, or nothing. Takes effect right away, also while streaming.
+void rtmpstreamer_tilde_monitor(t_rtmpstreamer_tilde *x, t_symbol *s) {
+  for (int i = 0; i <= MONITOR_OFF; i++) {
+    if (!strcmp(s->s_name, monitor_mode_names[i])) {
+      atomic_store(&x->st->monitor, i);
+      return;
     }
+  }
+  pd_error(x, "[rtmpstreamer~] monitor: unknown mode '%s' (input, stream or "
+              "off)",
+           s->s_name);
+}
+
+// Turn an archive path into a segment file pattern. A path without a
+// printf-style counter gets one before its extension, so
+// "/rec/show.mkv" becomes "/rec/show-%05d.mkv"; without an extension the
+// files are flv.
+static t_symbol *archive_pattern(t_symbol *path) {
+  const char *name = path->s_name;
+  if (strchr(name, '%'))
+    return path;
+
+  char pattern[MAXPDSTRING];
+  const char *slash = strrchr(name, '/');
+  const char *dot = strrchr(name, '.');
+  if (dot && (!slash || dot > slash))
+    snprintf(pattern, sizeof(pattern), "%.*s-%%05d%s", (int)(dot - name), name,
+             dot);
+  else
+    snprintf(pattern, sizeof(pattern), "%s-%%05d.flv", name);
+  return gensym(pattern);
+}
+
+// "archive <path> [<seconds>]" also records the encoded stream into local
+// files of <seconds> each (default 600); the extension picks the container
+// (flv, mkv, mp4, ...). "archive off" stops recording. Recording runs on its
+// own writer task, so it never holds up the live outputs. A running stream
+// is restarted.
+void rtmpstreamer_tilde_archive(t_rtmpstreamer_tilde *x, t_symbol *s, int argc,
+                                t_atom *argv) {
+  t_symbol *path = argc > 0 ? atom_getsymbol(argv) : gensym("off");
+  if (!*path->s_name || path == gensym("off")) {
+    x->archive_path = NULL;
+    post("[rtmpstreamer~] archive: off");
   } else {
-    post("[rtmpstreamer~] Invalid or empty URL. Non-streaming mode.");
+    x->archive_path = archive_pattern(path);
+    x->archive_segment = argc > 1 && atom_getfloat(argv + 1) > 0
+                             ? atom_getfloat(argv + 1)
+                             : RTMP_DEFAULT_SEGMENT_SECONDS;
+    post("[rtmpstreamer~] archive: %s, %g seconds per file",
+         x->archive_path->s_name, x->archive_segment);
   }
+  // The next session gets the destinations with or without the archive
+  x->outputs_changed = 1;
+  restart_streaming_worker(x);
 }
 
 // Destructor
 void rtmpstreamer_tilde_free(t_rtmpstreamer_tilde *x) {
-  // Clean up streaming if active
-  if (x->streaming_active) {
-    cleanup_streaming(x);
+  // A running session finishes in the background, closing its connections,
+  // and frees the streamer once it is done
+  if (x->st) {
+    stop_streaming_worker(x);
+    streamer_release(x->st);
   }
+
+  clock_free(x->clock);
+  clock_free(x->stats_clock);
+  worker_pool_release();
+  network_release();
 }
 
 // Setup function
 void rtmpstreamer_tilde_setup(void) {
+  const char *kernels = select_sample_kernels();
+  logpost(NULL, 4, "[rtmpstreamer~] Using %s sample kernels", kernels);
+  network_retain(); // Held for as long as the class is loaded
+
   rtmpstreamer_tilde_class =
       class_new(gensym("rtmpstreamer~"), (t_newmethod)rtmpstreamer_tilde_new,
                 (t_method)rtmpstreamer_tilde_free, sizeof(t_rtmpstreamer_tilde),
-                CLASS_DEFAULT, A_DEFSYM, 0);
+                CLASS_DEFAULT, A_GIMME, 0);
 
   class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_dsp,
                   gensym("dsp"), A_CANT, 0);
   CLASS_MAINSIGNALIN(rtmpstreamer_tilde_class, t_rtmpstreamer_tilde, f);
   class_addsymbol(rtmpstreamer_tilde_class, rtmpstreamer_tilde_symbol);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_url,
+                  gensym("url"), A_GIMME, 0);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_start,
+                  gensym("start"), 0);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_stop,
+                  gensym("stop"), 0);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_pause,
+                  gensym("pause"), A_DEFSYM, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_resume, gensym("resume"), 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_reconnect, gensym("reconnect"),
+                  A_FLOAT, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_preroll, gensym("preroll"),
+                  A_FLOAT, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_overflow, gensym("overflow"),
+                  A_SYMBOL, 0);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_stats,
+                  gensym("stats"), A_GIMME, 0);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_codec,
+                  gensym("codec"), A_SYMBOL, A_DEFFLOAT, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_latency, gensym("latency"),
+                  A_SYMBOL, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_samplerate, gensym("samplerate"),
+                  A_FLOAT, 0);
+  class_addmethod(rtmpstreamer_tilde_class, (t_method)rtmpstreamer_tilde_abr,
+                  gensym("abr"), A_FLOAT, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_ladder, gensym("ladder"),
+                  A_GIMME, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_monitor, gensym("monitor"),
+                  A_SYMBOL, 0);
+  class_addmethod(rtmpstreamer_tilde_class,
+                  (t_method)rtmpstreamer_tilde_archive, gensym("archive"),
+                  A_GIMME, 0);
 }
 
-// Helper function to initialize streaming
-int initialize_streaming(t_rtmpstreamer_tilde *x) {
-  // Initialize FFmpeg libraries
-  avformat_network_init();
-
-  // Allocate the output media context
-  // Change the output format to "flv" which is commonly used with RTMP
-  if (avformat_alloc_output_context2(&x->fmt_ctx, NULL, "flv", x->url->s_name) <
-      0) {
-    pd_error(x, "[rtmpstreamer~] Could not allocate output context");
-    return -1;
+// Encoder options of low-latency mode that are not context fields
+static void low_latency_options(t_streamer *x, AVDictionary **opts) {
+  if (x->codec->id == AV_CODEC_ID_OPUS) {
+    av_dict_set_int(opts, "frame_duration", RTMP_LOW_LATENCY_FRAME_MS, 0);
+    av_dict_set(opts, "application", "lowdelay", 0);
+  }
+}
+
+// Open another encoder like the main one but at bit_rate, so their packets
+// can replace each other in a stream. NULL on failure.
+static AVCodecContext *open_rendition_encoder(t_streamer *x, int64_t bit_rate) {
+  const AVCodecContext *top = x->codec_ctx;
+  AVCodecContext *ctx = avcodec_alloc_context3(top->codec);
+  if (!ctx || av_channel_layout_copy(&ctx->ch_layout, &top->ch_layout) < 0) {
+    avcodec_free_context(&ctx);
+    return NULL;
+  }
+  ctx->sample_fmt = top->sample_fmt;
+  ctx->sample_rate = top->sample_rate;
+  ctx->time_base = top->time_base;
+  ctx->bits_per_raw_sample = top->bits_per_raw_sample;
+  ctx->strict_std_compliance = top->strict_std_compliance;
+  ctx->flags = top->flags;
+  ctx->profile = top->profile;
+  ctx->bit_rate = bit_rate;
+  use_pooled_encode_buffers(x, ctx);
+
+  AVDictionary *opts = NULL;
+  if (x->low_latency)
+    low_latency_options(x, &opts);
+  int ret = avcodec_open2(ctx, top->codec, &opts);
+  av_dict_free(&opts);
+  if (ret < 0 || ctx->frame_size != top->frame_size ||
+      ctx->initial_padding != top->initial_padding) {
+    avcodec_free_context(&ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// Open the renditions besides the main encoder: the rest of the ladder, or
+// with adaptive bitrate and no ladder, rungs at half the rate of the one
+// above down to the codec's lowest useful rate. A missing ladder rendition
+// fails the session; a missing rung only limits how far outputs can step
+// down.
+static int open_renditions(t_streamer *x) {
+  int64_t rates[RTMP_MAX_RENDITIONS];
+  int count = 0;
+  if ((x->ladder_size > 0 || x->abr) && x->codec->min_bit_rate == 0) {
+    streaming_error(x, "[rtmpstreamer~] Bitrate ladders and adaptive bitrate "
+                       "need a lossy codec, %s is lossless",
+                    x->codec->name);
+    return 0;
+  }
+  if (x->ladder_size > 0) {
+    for (int i = 1; i < x->ladder_size; i++)
+      rates[count++] = x->ladder[i];
+  } else if (x->abr) {
+    for (int64_t b = x->codec_ctx->bit_rate / 2;
+         count + 1 < RTMP_ABR_RUNGS && b >= x->codec->min_bit_rate; b /= 2)
+      rates[count++] = b;
+  }
+
+  for (int i = 0; i < count; i++) {
+    t_rendition *rd = &x->renditions[x->num_renditions];
+    rd->ctx = open_rendition_encoder(x, rates[i]);
+    rd->packet = rd->ctx ? av_packet_alloc() : NULL;
+    if (!rd->packet) {
+      streaming_error(x, "[rtmpstreamer~] Could not open %s encoder at %d "
+                         "kbps",
+                      x->codec_ctx->codec->name, (int)(rates[i] / 1000));
+      avcodec_free_context(&rd->ctx);
+      if (x->ladder_size > 0)
+        return -1;
+      break;
+    }
+    atomic_store(&rd->job, JOB_IDLE);
+    pool_task_start(&rd->task);
+    x->num_renditions++;
+  }
+  return 0;
+}
+
+// Nonzero if the URL's container holds a single audio stream: FLV, Icecast
+// and raw audio files
+static int single_stream_url(const char *url) {
+  const t_transport *transport = find_transport(url);
+  const char *format = transport ? transport->format : "flv";
+  if (!transport) {
+    const AVOutputFormat *guessed = av_guess_format(NULL, url, NULL);
+    if (guessed)
+      format = guessed->name;
+  }
+  return !format || !strcmp(format, "flv") || !strcmp(format, "adts") ||
+         !strcmp(format, "mp3") || !strcmp(format, "flac") ||
+         !strcmp(format, "wav");
+}
+
+// Give every output its rendition: the i-th URL carries the i-th rendition
+// of the ladder and URLs beyond it the main one; the archive records the
+// main one. With fewer URLs than renditions, the last URL carries the rest
+// as extra audio streams, which takes a container with room for several
+// (MPEG-TS, Matroska), not FLV.
+static void assign_renditions(t_streamer *x) {
+  int urls = 0;
+  for (int i = 0; i < x->num_outputs; i++) {
+    t_rtmp_output *out = &x->outputs[i];
+    out->rendition = x->ladder_size > 0 && !out->archive &&
+                             i < x->num_renditions
+                         ? i
+                         : 0;
+    for (int r = 0; r < RTMP_MAX_RENDITIONS; r++)
+      out->extra_stream[r] = 0;
+    out->num_streams = 1;
+    if (!out->archive)
+      urls++;
+  }
+  if (x->ladder_size == 0 || urls == 0 || urls >= x->num_renditions)
+    return;
+
+  t_rtmp_output *last = &x->outputs[urls - 1];
+  if (single_stream_url(last->url->s_name)) {
+    streaming_error(x, "[rtmpstreamer~] '%s' carries a single stream, %d "
+                       "renditions have no URL",
+                    last->url->s_name, x->num_renditions - urls);
+    return;
   }
+  for (int r = urls; r < x->num_renditions; r++)
+    last->extra_stream[r] = last->num_streams++;
+}
 
-  // Find the encoder for AAC, which is standard for RTMP audio
-  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+// Helper function to initialize streaming
+//
+// Opens the encoder shared by all outputs. Runs on the streaming worker.
+int initialize_streaming(t_streamer *x) {
+  // Find the encoder; AAC is the default, being standard for RTMP audio.
+  // Low-delay AAC (AAC-LD) is only available from libfdk_aac
+  const AVCodec *codec = NULL;
+  int aac_ld = 0;
+  if (x->low_latency && x->codec->id == AV_CODEC_ID_AAC) {
+    codec = avcodec_find_encoder_by_name("libfdk_aac");
+    aac_ld = codec != NULL;
+    if (!aac_ld)
+      streaming_error(x, "[rtmpstreamer~] AAC-LD needs libfdk_aac, using "
+                         "AAC-LC");
+  }
+  if (!codec)
+    codec = find_encoder(x->codec);
   if (!codec) {
-    pd_error(x, "[rtmpstreamer~] AAC codec not found");
+    streaming_error(x, "[rtmpstreamer~] No encoder for %s", x->codec->name);
     return -1;
   }
-
-  // Create a new audio stream in the output file
-  x->audio_st = avformat_new_stream(x->fmt_ctx, NULL);
-  if (!x->audio_st) {
-    pd_error(x, "[rtmpstreamer~] Could not allocate stream");
+  enum AVSampleFormat sample_fmt = select_sample_fmt(codec);
+  if (sample_fmt == AV_SAMPLE_FMT_NONE) {
+    streaming_error(x, "[rtmpstreamer~] Encoder %s takes no supported sample "
+                       "format",
+                    codec->name);
     return -1;
   }
-  x->audio_st->id = x->fmt_ctx->nb_streams - 1;
 
   // Allocate and configure the codec context
   x->codec_ctx = avcodec_alloc_context3(codec);
   if (!x->codec_ctx) {
-    pd_error(x, "[rtmpstreamer~] Could not allocate codec context");
+    streaming_error(x, "[rtmpstreamer~] Could not allocate codec context");
     return -1;
   }
 
-  // Initialize Channel Layout
-  AVChannelLayout layout = {AV_CH_LAYOUT_MONO, 1, {0}, NULL};
+  // Initialize Channel Layout: mono, stereo, ... 5.1, 7.1
+  AVChannelLayout layout;
+  av_channel_layout_default(&layout, x->channels);
   if (av_channel_layout_copy(&x->codec_ctx->ch_layout, &layout) < 0) {
-    pd_error(x, "[rtspstreamer~] Could not set channel layout");
+    streaming_error(x, "[rtmpstreamer~] Could not set channel layout");
     return -1;
   }
 
   // Set codec parameters
-  x->codec_ctx->sample_fmt =
-      AV_SAMPLE_FMT_FLTP;          // AAC typically uses floating point planar
-  x->codec_ctx->bit_rate = 128000; // Increased bitrate for better audio quality
-  x->codec_ctx->sample_rate = sys_getsr(); // Get Pd's sample rate
-  // x->codec_ctx->channels = 1;                   // Number of channels
+  x->codec_ctx->sample_fmt = sample_fmt;
+  x->codec_ctx->bit_rate =
+      x->ladder_size > 0 && x->codec->min_bit_rate > 0 ? x->ladder[0]
+      : x->bit_rate > 0                                ? x->bit_rate
+                                                       : x->codec->default_bit_rate;
+  // Stream at the configured rate, or Pd's, as far as the encoder allows;
+  // anything else is resampled on this thread
+  int pd_rate = x->start_rate;
+  x->codec_ctx->sample_rate =
+      select_sample_rate(codec, x->out_rate > 0 ? x->out_rate : pd_rate);
+  if (sample_fmt == AV_SAMPLE_FMT_S32 || sample_fmt == AV_SAMPLE_FMT_S32P)
+    x->codec_ctx->bits_per_raw_sample = 24; // Lossless codecs: 24-bit audio
+  if (codec->capabilities & AV_CODEC_CAP_EXPERIMENTAL)
+    x->codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+  // Frame pts count samples
+  x->codec_ctx->time_base = (AVRational){1, x->codec_ctx->sample_rate};
+  use_pooled_encode_buffers(x, x->codec_ctx);
+
+  // Low-latency mode: no lookahead beyond what the codec needs, and frames
+  // of a few milliseconds where the codec allows it
+  AVDictionary *codec_opts = NULL;
+  int low_frame = x->codec_ctx->sample_rate * RTMP_LOW_LATENCY_FRAME_MS / 1000;
+  if (x->low_latency) {
+    x->codec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    if (aac_ld)
+      x->codec_ctx->profile = AV_PROFILE_AAC_LD;
+    low_latency_options(x, &codec_opts);
+    if (x->codec->id == AV_CODEC_ID_FLAC)
+      x->codec_ctx->frame_size = low_frame;
+  }
 
   // Open the codec
-  if (avcodec_open2(x->codec_ctx, codec, NULL) < 0) {
-    pd_error(x, "[rtmpstreamer~] Could not open codec");
+  int ret = avcodec_open2(x->codec_ctx, codec, &codec_opts);
+  av_dict_free(&codec_opts);
+  if (ret < 0) {
+    streaming_error(x, "[rtmpstreamer~] Could not open %s encoder at %d Hz",
+                    codec->name, x->codec_ctx->sample_rate);
     return -1;
   }
 
-  // Set the codec parameters to the stream
-  if (avcodec_parameters_from_context(x->audio_st->codecpar, x->codec_ctx) <
-      0) {
-    pd_error(x, "[rtmpstreamer~] Could not copy codec parameters");
+  x->renditions[0].ctx = x->codec_ctx;
+  x->renditions[0].packet = av_packet_alloc();
+  if (!x->renditions[0].packet) {
+    streaming_error(x, "[rtmpstreamer~] Could not allocate packets");
     return -1;
   }
+  x->num_renditions = 1;
+  if (open_renditions(x) < 0)
+    return -1;
+  assign_renditions(x);
 
-  // Set stream time base
-  x->audio_st->time_base = (AVRational){1, x->codec_ctx->sample_rate};
+  if (open_resampler(x, pd_rate) < 0)
+    return -1;
 
-  // Open the output URL
-  if (!(x->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-    if (avio_open(&x->fmt_ctx->pb, x->url->s_name, AVIO_FLAG_WRITE) < 0) {
-      pd_error(x, "[rtmpstreamer~] Could not open output URL '%s'",
-               x->url->s_name);
-      return -1;
-    }
+  // Frames are filled to exactly frame_size samples by the accumulator
+  x->frame_capacity = x->codec_ctx->frame_size;
+  if (x->frame_capacity == 0) {
+    // Set a default frame size
+    x->frame_capacity = x->low_latency && low_frame > 0 ? low_frame : 1024;
   }
 
-  // Write the stream header
-  AVDictionary *opts = NULL;
-  // Set RTMP-specific options
-  av_dict_set(&opts, "rtmp_buffer", "0.5", 0); // Example: set buffer duration
-  av_dict_set(&opts, "rtmp_live", "live", 0);  // Set live streaming mode
-  if (avformat_write_header(x->fmt_ctx, &opts) < 0) {
-    pd_error(x, "[rtmpstreamer~] Error occurred when opening output URL");
-    av_dict_free(&opts);
+  x->poll_ms = x->low_latency ? RTMP_LOW_LATENCY_POLL_MS : RTMP_WORKER_POLL_MS;
+  update_pipeline_latency(x);
+
+  // Pick the conversion from the accumulated float planes once per session
+  int supported;
+  x->convert = select_frame_converter(x->codec_ctx->sample_fmt, &supported);
+  if (!supported) {
+    streaming_error(x, "[rtmpstreamer~] Unsupported sample format %s",
+                    av_get_sample_fmt_name(x->codec_ctx->sample_fmt));
     return -1;
   }
-  av_dict_free(&opts);
+  if (x->convert) {
+    x->staging_size = (size_t)x->frame_capacity * x->channels * sizeof(float);
+    x->staging = (float *)getbytes(x->staging_size);
+    if (!x->staging) {
+      streaming_error(x, "[rtmpstreamer~] Could not allocate staging buffer");
+      return -1;
+    }
+  }
 
-  // Allocate an audio frame
-  x->frame = av_frame_alloc();
-  if (!x->frame) {
-    pd_error(x, "[rtmpstreamer~] Could not allocate audio frame");
-    return -1;
+  // Allocate the audio frames and their data buffers up front; they are
+  // reused for the whole session
+  for (int i = 0; i < RTMP_FRAME_POOL; i++) {
+    AVFrame *frame = x->frames[i] = av_frame_alloc();
+    if (!frame) {
+      streaming_error(x, "[rtmpstreamer~] Could not allocate audio frame");
+      return -1;
+    }
+    frame->format = x->codec_ctx->sample_fmt;
+    frame->sample_rate = x->codec_ctx->sample_rate;
+    frame->nb_samples = x->frame_capacity;
+    if (av_channel_layout_copy(&frame->ch_layout, &x->codec_ctx->ch_layout) <
+            0 ||
+        av_frame_get_buffer(frame, 0) < 0) {
+      streaming_error(x,
+                      "[rtmpstreamer~] Could not allocate audio data buffers");
+      return -1;
+    }
   }
+  x->frame_index = 0;
+  x->frame = x->frames[0];
 
-  x->frame->format = x->codec_ctx->sample_fmt;
-  x->frame->sample_rate = x->codec_ctx->sample_rate;
-  x->frame->nb_samples = x->codec_ctx->frame_size;
-  if (x->frame->nb_samples == 0) {
-    x->frame->nb_samples = 1024; // Set a default frame size
+  // Packets for every output's queue, plus the one its writer holds and one
+  // per rendition: the renditions dispatch in parallel, and each may hold a
+  // packet for the output while its full queue drops another. The encoders
+  // and the stream monitor use packets of their own.
+  if (packet_pool_init(&x->packets,
+                       x->num_outputs * (RTMP_OUTPUT_QUEUE_PACKETS + 1 +
+                                         x->num_renditions)) < 0) {
+    streaming_error(x, "[rtmpstreamer~] Could not allocate packets");
+    return -1;
   }
 
-  // Allocate the data buffers
-  if (av_frame_get_buffer(x->frame, 0) < 0) {
-    pd_error(x, "[rtmpstreamer~] Could not allocate audio data buffers");
+  // Packet payloads, as large as a frame of raw samples plus some slack.
+  // The pool grows to the packets in flight and keeps them for the session.
+  x->packet_buffer_size =
+      x->frame_capacity * x->channels *
+          av_get_bytes_per_sample(x->codec_ctx->sample_fmt) +
+      RTMP_PACKET_BUFFER_SLACK + AV_INPUT_BUFFER_PADDING_SIZE;
+  x->packet_buffers = av_buffer_pool_init(x->packet_buffer_size, NULL);
+  if (!x->packet_buffers) {
+    streaming_error(x, "[rtmpstreamer~] Could not allocate packet buffers");
     return -1;
   }
 
@@ -317,22 +4272,194 @@ int initialize_streaming(t_rtmpstreamer_tilde *x) {
 }
 
 // Helper function to clean up streaming
-void cleanup_streaming(t_rtmpstreamer_tilde *x) {
-  if (x->fmt_ctx) {
-    av_write_trailer(x->fmt_ctx);
-    if (!(x->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-      avio_closep(&x->fmt_ctx->pb);
-    }
-    avformat_free_context(x->fmt_ctx);
-    x->fmt_ctx = NULL;
+//
+// Releases the encoder, also after a partially failed initialization.
+void cleanup_streaming(t_streamer *x) {
+  for (int i = 1; i < x->num_renditions; i++) {
+    pool_task_cancel(&x->renditions[i].task);
+    avcodec_free_context(&x->renditions[i].ctx);
   }
+  for (int i = 0; i < x->num_renditions; i++)
+    av_packet_free(&x->renditions[i].packet);
+  x->renditions[0].ctx = NULL;
+  x->num_renditions = 0;
   if (x->codec_ctx) {
     avcodec_free_context(&x->codec_ctx);
     x->codec_ctx = NULL;
   }
-  if (x->frame) {
-    av_frame_free(&x->frame);
-    x->frame = NULL;
+  for (int i = 0; i < RTMP_FRAME_POOL; i++)
+    av_frame_free(&x->frames[i]);
+  x->frame = NULL;
+  x->frame_fill = 0;
+  packet_pool_free(&x->packets);
+  // Buffers still referenced by queued packets are freed when released
+  av_buffer_pool_uninit(&x->packet_buffers);
+  if (x->staging) {
+    freebytes(x->staging, x->staging_size);
+    x->staging = NULL;
+  }
+  x->convert = NULL;
+  swr_free(&x->resampler);
+  if (x->resample_in) {
+    freebytes(x->resample_in, RTMP_RESAMPLE_CHUNK * x->channels * sizeof(float));
+    x->resample_in = NULL;
+  }
+  close_monitor(x);
+  x->monitor_failed = 0;
+}
+
+// Open the connection of one output and write the stream header. Runs on the
+// output's writer task; the encoder must already be open.
+int open_output(t_streamer *x, t_rtmp_output *out) {
+  const char *url = out->url->s_name;
+  // Name lookup, connection, handshake and header together
+  arm_io_deadline(out, RTMP_CONNECT_TIMEOUT_MS);
+
+  // Pick the muxer and protocol options from the URL scheme. The archive is
+  // written by the segment muxer, which starts a new file every segment and
+  // takes the container from the pattern's extension
+  const t_transport *transport = out->archive ? NULL : find_transport(url);
+  const char *format = out->archive ? "segment" : transport ? transport->format
+                                                            : NULL;
+  const char *content_type = NULL;
+  if (transport && !format) {
+    format = icecast_format(x->codec_ctx->codec_id, &content_type);
+    if (!format) {
+      streaming_error(x, "[rtmpstreamer~] Icecast cannot carry %s audio",
+                      x->codec->name);
+      return -1;
+    }
+  }
+
+  // Allocate the output media context. Files are muxed according to their
+  // extension, falling back to flv
+  if (avformat_alloc_output_context2(&out->fmt_ctx, NULL, format, url) < 0 &&
+      (format || avformat_alloc_output_context2(&out->fmt_ctx, NULL, "flv",
+                                                url) < 0)) {
+    streaming_error(x, "[rtmpstreamer~] Could not allocate output context "
+                       "for '%s'",
+                    url);
+    return -1;
+  }
+  const AVOutputFormat *container =
+      out->archive ? av_guess_format(NULL, url, NULL) : out->fmt_ctx->oformat;
+  if (!container) {
+    streaming_error(x, "[rtmpstreamer~] Unknown archive file type '%s'", url);
+    return -1;
+  }
+  if (avformat_query_codec(container, x->codec_ctx->codec_id,
+                           FF_COMPLIANCE_NORMAL) != 1) {
+    streaming_error(x, "[rtmpstreamer~] %s cannot carry %s audio",
+                    container->name, x->codec->name);
+    return -1;
+  }
+  // Low-latency mode: write each packet straight through and flush it. The
+  // archive is not listened to live, so it keeps the default buffering, and
+  // outputs carrying several renditions still need their streams interleaved
+  out->direct_write =
+      x->low_latency && !out->archive && out->num_streams == 1;
+  if (out->direct_write) {
+    out->fmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    out->fmt_ctx->flush_packets = 1;
+    out->fmt_ctx->max_delay = 0;
+  }
+  // Interrupt a connect or write that hangs past its deadline or the stop
+  out->fmt_ctx->interrupt_callback.callback = streaming_interrupt_cb;
+  out->fmt_ctx->interrupt_callback.opaque = out;
+
+  // Create a new audio stream in the output file
+  out->audio_st = avformat_new_stream(out->fmt_ctx, NULL);
+  if (!out->audio_st) {
+    streaming_error(x, "[rtmpstreamer~] Could not allocate stream");
+    return -1;
+  }
+  out->audio_st->id = out->fmt_ctx->nb_streams - 1;
+
+  // Set the codec parameters to the stream
+  if (avcodec_parameters_from_context(out->audio_st->codecpar,
+                                      x->renditions[out->rendition].ctx) < 0) {
+    streaming_error(x, "[rtmpstreamer~] Could not copy codec parameters");
+    return -1;
+  }
+
+  // Set stream time base
+  out->audio_st->time_base = (AVRational){1, x->codec_ctx->sample_rate};
+
+  // Renditions carried besides the main one get streams of their own, in
+  // the order of their extra_stream indices
+  for (int r = 0; r < x->num_renditions; r++) {
+    if (!out->extra_stream[r])
+      continue;
+    AVStream *st = avformat_new_stream(out->fmt_ctx, NULL);
+    if (!st || avcodec_parameters_from_context(st->codecpar,
+                                               x->renditions[r].ctx) < 0) {
+      streaming_error(x, "[rtmpstreamer~] Could not allocate stream");
+      return -1;
+    }
+    st->id = out->fmt_ctx->nb_streams - 1;
+    st->time_base = out->audio_st->time_base;
+  }
+
+  // Open the output URL. Protocols such as RTSP connect in the muxer
+  if (!(out->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+    AVDictionary *io_opts = NULL;
+    if (content_type)
+      av_dict_set(&io_opts, "content_type", content_type, 0);
+    // A write that makes no progress fails rather than blocking the writer
+    av_dict_set_int(&io_opts, "rw_timeout", RTMP_WRITE_TIMEOUT_MS * 1000LL, 0);
+    if (!strncmp(url, "rtmp", 4)) {
+      // Set RTMP-specific options
+      // Buffer in ms; none in low-latency mode
+      av_dict_set(&io_opts, "rtmp_buffer", x->low_latency ? "0" : "500", 0);
+      av_dict_set(&io_opts, "rtmp_live", "live", 0);  // Live streaming mode
+    }
+    if (x->low_latency && !strncmp(url, "tcp://", 6))
+      av_dict_set(&io_opts, "tcp_nodelay", "1", 0);
+    int ret = avio_open2(&out->fmt_ctx->pb, url, AVIO_FLAG_WRITE,
+                         &out->fmt_ctx->interrupt_callback, &io_opts);
+    av_dict_free(&io_opts);
+    if (ret < 0) {
+      streaming_error(x, "[rtmpstreamer~] Could not open output URL '%s'", url);
+      return -1;
+    }
+  }
+
+  // Write the stream header. Archive files start their timestamps at zero so
+  // each one plays on its own
+  AVDictionary *mux_opts = NULL;
+  if (out->archive) {
+    // A duration string, so fractional seconds are kept
+    char segment_time[32];
+    snprintf(segment_time, sizeof(segment_time), "%g", x->archive_segment);
+    av_dict_set(&mux_opts, "segment_time", segment_time, 0);
+    av_dict_set(&mux_opts, "reset_timestamps", "1", 0);
+  }
+  int ret = avformat_write_header(out->fmt_ctx, &mux_opts);
+  av_dict_free(&mux_opts);
+  if (ret < 0) {
+    streaming_error(x, "[rtmpstreamer~] Error occurred when opening output "
+                       "URL '%s'",
+                    url);
+    return -1;
+  }
+  out->header_written = 1;
+  return 0;
+}
+
+// Finish and close the connection of one output, also after a partially
+// failed open_output.
+void close_output(t_rtmp_output *out) {
+  if (!out->fmt_ctx)
+    return;
+  arm_io_deadline(out, RTMP_WRITE_TIMEOUT_MS);
+
+  if (out->header_written)
+    av_write_trailer(out->fmt_ctx);
+  out->header_written = 0;
+  if (!(out->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+    avio_closep(&out->fmt_ctx->pb);
   }
-  avformat_network_deinit();
-}
\ No newline at end of file
+  avformat_free_context(out->fmt_ctx);
+  out->fmt_ctx = NULL;
+  out->audio_st = NULL;
+}